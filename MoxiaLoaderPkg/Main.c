@@ -1,6 +1,7 @@
 #include "elf.hpp"
 #include "frame_buffer_config.hpp"
 #include "memory_map.hpp"
+#include <Guid/Acpi.h>
 #include <Guid/FileInfo.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
@@ -393,10 +394,18 @@ EFI_STATUS UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table) {
     frame_buffer[i] = 0;
   }
 
+  VOID *acpi_table = NULL;
+  for (UINTN i = 0; i < system_table->NumberOfTableEntries; ++i) {
+    if (CompareGuid(&gEfiAcpiTableGuid, &system_table->ConfigurationTable[i].VendorGuid)) {
+      acpi_table = system_table->ConfigurationTable[i].VendorTable;
+      break;
+    }
+  }
+
   UINT64 entry_addr = *(UINT64 *)(kernel_first_addr + 24);
-  typedef void EntryPointType(const struct FrameBufferConfig *, const struct MemoryMap *, VOID *);
+  typedef void EntryPointType(const struct FrameBufferConfig *, const struct MemoryMap *, VOID *, VOID *);
   EntryPointType *entry_point = (EntryPointType *)entry_addr;
-  entry_point(&config, &memmap, volume_image);
+  entry_point(&config, &memmap, volume_image, acpi_table);
 
   Print(L"All done\n");
 
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
 int close(int fd) {
   errno = EBADF;
@@ -78,6 +80,35 @@ ssize_t write(int fd, const void *buf, size_t count) {
   return -1;
 }
 
+// saturates instead of wrapping, so a huge sleep stays huge
+static void SleepFor(uint64_t sec, uint64_t nsec) {
+  const uint64_t max_sec = (UINT64_MAX - nsec) / 1000000000;
+  SyscallSleep(sec > max_sec ? UINT64_MAX : sec * 1000000000 + nsec);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+  if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000) {
+    errno = EINVAL;
+    return -1;
+  }
+  SleepFor(req->tv_sec, req->tv_nsec);
+  if (rem) {
+    rem->tv_sec = 0;
+    rem->tv_nsec = 0;
+  }
+  return 0;
+}
+
+unsigned int sleep(unsigned int seconds) {
+  SleepFor(seconds, 0);
+  return 0;
+}
+
+int usleep(useconds_t usec) {
+  SyscallSleep((uint64_t)usec * 1000);
+  return 0;
+}
+
 void _exit(int status) {
   SyscallExit(status);
 }
@@ -0,0 +1,47 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+const size_t kBufBytes = 64 << 20;
+const size_t kPageBytes = 4096;
+
+// 2 MiB aligned, so that the kernel can back it with huge pages unless built with HUGE_PAGES=off
+alignas(2 << 20) uint8_t buf[kBufBytes];
+
+uint64_t ReadTSC() {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc"
+                   : "=a"(lo), "=d"(hi));
+  return static_cast<uint64_t>(hi) << 32 | lo;
+}
+} // namespace
+
+extern "C" void main(int argc, char **argv) {
+  int rounds = 16;
+  if (argc >= 2) {
+    rounds = atoi(argv[1]);
+  }
+
+  auto begin = ReadTSC();
+  for (size_t i = 0; i < kBufBytes; i += kPageBytes) {
+    buf[i] = 1;
+  }
+  const auto touch_cycles = ReadTSC() - begin;
+
+  // one cache line per page, shifted so that the lines do not all fall into the same cache set
+  uint64_t sum = 0;
+  begin = ReadTSC();
+  for (int round = 0; round < rounds; ++round) {
+    for (size_t i = 0; i < kBufBytes; i += kPageBytes) {
+      sum += buf[i + (i / kPageBytes) % 64 * 64];
+    }
+  }
+  const auto scan_cycles = ReadTSC() - begin;
+
+  const size_t num_pages = kBufBytes / kPageBytes;
+  printf("buf: %p, %lu MiB\n", buf, kBufBytes >> 20);
+  printf("first touch: %lu cycles/page\n", touch_cycles / num_pages);
+  printf("scan: %lu cycles/page (sum %lu)\n", scan_cycles / (num_pages * rounds), sum);
+  exit(0);
+}
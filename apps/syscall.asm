@@ -28,3 +28,24 @@ SyscallExit:
   mov r10, rcx
   syscall
   ret
+
+global SyscallSleep
+SyscallSleep:
+  mov rax, 0x80000004
+  mov r10, rcx
+  syscall
+  ret
+
+global SyscallPeriodicTimer
+SyscallPeriodicTimer:
+  mov rax, 0x80000005
+  mov r10, rcx
+  syscall
+  ret
+
+global SyscallWaitTimer
+SyscallWaitTimer:
+  mov rax, 0x80000006
+  mov r10, rcx
+  syscall
+  ret
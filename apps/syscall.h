@@ -15,6 +15,11 @@ struct SyscallResult SyscallRead(int fd, const void *buf, size_t len);
 struct SyscallResult SyscallWrite(int fd, const void *buf, size_t len);
 struct SyscallResult SyscallOpen(const char *path, int flags);
 void SyscallExit(int exit_code);
+struct SyscallResult SyscallSleep(uint64_t nsec);
+// fires every period_nsec nanoseconds until called again; 0 stops it
+struct SyscallResult SyscallPeriodicTimer(uint64_t period_nsec);
+// waits for the periodic timer; value is the number of periods since the last wait
+struct SyscallResult SyscallWaitTimer(void);
 
 #ifdef __cplusplus
 }
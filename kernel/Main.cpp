@@ -1,4 +1,6 @@
+#include "acpi.hpp"
 #include "asmfunc.hpp"
+#include "benchmark.hpp"
 #include "console.hpp"
 #include "fat.hpp"
 #include "graphics.hpp"
@@ -11,10 +13,12 @@
 #include "pic.hpp"
 #include "printk.hpp"
 #include "segment.hpp"
+#include "smp.hpp"
 #include "syscall.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
 #include "timer.hpp"
+#include <array>
 #include <cstdint>
 #include <deque>
 
@@ -33,48 +37,70 @@ void TaskB(uint64_t task_id, int64_t data) {
 }
 
 extern "C" void
-KernelMainNewStack(const FrameBufferConfig &frame_buffer_config, const MemoryMap &memory_map, void *volume_image) {
+KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_ref, const MemoryMap &memory_map_ref, void *volume_image,
+                   const acpi::RSDP *acpi_table) {
+  RecordBootPhase("entry");
+  // the loader passes these on its stack, which the memory manager treats as free memory
+  const FrameBufferConfig frame_buffer_config{frame_buffer_config_ref};
+  const MemoryMap memory_map{memory_map_ref};
+
   InitializeGraphics(frame_buffer_config);
   InitializeConsole();
 
   printk("Hello, world!\n");
+  RecordBootPhase("console");
 
   InitializeSegmentation();
   InitializePaging();
+  MapFrameBufferWriteCombining(frame_buffer_config);
+  RecordBootPhase("paging");
   InitializeMemoryManager(memory_map);
+  FreeUnusedPageDirectories();
+  RecordBootPhase("memory manager");
   InitializePIC();
   InitializeTSS();
   InitializeInterrupt();
+  RecordBootPhase("interrupt");
 
   fat::Initialize(volume_image);
+  acpi::Initialize(acpi_table);
 
   InitializeLAPICTimer();
   InitializeSyscall();
 
   InitializeTask();
+  RecordBootPhase("task");
+  StartAPs();
+  RecordBootPhase("smp");
   Task &terminal_task = task_manager->NewTask().InitContext(TaskTerminal, 0).Wakeup();
 
   Task &main_task = task_manager->CurrentTask();
+  std::array<Message, 16> msgs;
   while (1) {
     __asm__("cli");
-    auto msg = main_task.ReceiveMessage();
-    if (!msg) {
+    const auto num_msgs = main_task.ReceiveMessages(msgs.data(), msgs.size());
+    if (num_msgs == 0) {
       main_task.Sleep();
       __asm__("sti");
       continue;
     }
     __asm__("sti");
 
-    switch (msg->type) {
-    case Message::kTimerTimeout:
-      printk("Timer: timeout = %lu, value = %d\n", msg->arg.timer.timeout, msg->arg.timer.value);
-      if (msg->arg.timer.value > 0) {
-        timer_manager->AddTimer(Timer(msg->arg.timer.timeout + 100, msg->arg.timer.value));
+    for (size_t i = 0; i < num_msgs; ++i) {
+      const auto &msg = msgs[i];
+      switch (msg.type) {
+      case Message::kTimerTimeout:
+        printk("Timer: timeout = %lu, value = %d\n", msg.arg.timer.timeout, msg.arg.timer.value);
+        if (msg.arg.timer.value > 0) {
+          timer_manager->AddTimer(Timer(msg.arg.timer.timeout + kTimerFreq, msg.arg.timer.value));
+        }
+        break;
+      case Message::kKeyboardPush:
+        __asm__("cli");
+        task_manager->SendMessage(terminal_task.ID(), msg);
+        __asm__("sti");
+        break;
       }
-      break;
-    case Message::kKeyboardPush:
-      task_manager->SendMessage(terminal_task.ID(), msg.value());
-      break;
     }
   }
 }
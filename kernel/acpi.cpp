@@ -0,0 +1,103 @@
+#include "acpi.hpp"
+#include "asmfunc.hpp"
+#include "printk.hpp"
+#include <string.h>
+
+namespace {
+template <class T>
+uint8_t SumBytes(const T *data, size_t bytes) {
+  const auto p = reinterpret_cast<const uint8_t *>(data);
+  uint8_t sum = 0;
+  for (size_t i = 0; i < bytes; ++i) {
+    sum += p[i];
+  }
+  return sum;
+}
+} // namespace
+
+namespace acpi {
+
+bool RSDP::IsValid() const {
+  if (strncmp(signature, "RSD PTR ", 8) != 0) {
+    printk("invalid RSDP signature: %.8s\n", signature);
+    return false;
+  }
+  if (revision != 2) {
+    printk("ACPI revision must be 2: %d\n", revision);
+    return false;
+  }
+  if (SumBytes(this, 20) != 0 || SumBytes(this, 36) != 0) {
+    printk("invalid RSDP checksum\n");
+    return false;
+  }
+  return true;
+}
+
+bool DescriptionHeader::IsValid(const char *expected_signature) const {
+  return strncmp(signature, expected_signature, 4) == 0 && SumBytes(this, length) == 0;
+}
+
+const DescriptionHeader &XSDT::operator[](size_t i) const {
+  auto entries = reinterpret_cast<const uint64_t *>(&header + 1);
+  return *reinterpret_cast<const DescriptionHeader *>(entries[i]);
+}
+
+size_t XSDT::Count() const {
+  return (header.length - sizeof(DescriptionHeader)) / sizeof(uint64_t);
+}
+
+const MADT *madt;
+const FADT *fadt;
+
+void WaitMilliseconds(unsigned long msec) {
+  const bool pm_timer_32 = fadt->flags & FADT::kTmrValExt;
+  const uint32_t start = Inl(fadt->pm_tmr_blk);
+  uint32_t end = start + kPMTimerFreq * msec / 1000;
+  if (!pm_timer_32) {
+    end &= 0x00ffffffu;
+  }
+
+  if (end < start) { // wraps around
+    while (Inl(fadt->pm_tmr_blk) >= start)
+      ;
+  }
+  while (Inl(fadt->pm_tmr_blk) < end)
+    ;
+}
+
+void Initialize(const RSDP *rsdp) {
+  if (rsdp == nullptr) {
+    printk("no ACPI 2.0 RSDP\n");
+    return;
+  }
+  if (!rsdp->IsValid()) {
+    return;
+  }
+
+  const auto &xsdt = *reinterpret_cast<const XSDT *>(rsdp->xsdt_address);
+  if (!xsdt.header.IsValid("XSDT")) {
+    printk("invalid XSDT\n");
+    return;
+  }
+
+  for (size_t i = 0; i < xsdt.Count(); ++i) {
+    const auto &entry = xsdt[i];
+    if (entry.IsValid("APIC")) {
+      madt = reinterpret_cast<const MADT *>(&entry);
+    } else if (entry.IsValid("FACP")) {
+      fadt = reinterpret_cast<const FADT *>(&entry);
+    }
+  }
+
+  if (!madt) {
+    printk("no MADT found\n");
+  }
+  if (fadt && fadt->pm_tmr_blk == 0) {
+    fadt = nullptr;
+  }
+  if (!fadt) {
+    printk("no ACPI PM timer found\n");
+  }
+}
+
+} // namespace acpi
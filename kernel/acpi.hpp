@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace acpi {
+
+struct RSDP {
+  char signature[8];
+  uint8_t checksum;
+  char oem_id[6];
+  uint8_t revision;
+  uint32_t rsdt_address;
+  uint32_t length;
+  uint64_t xsdt_address;
+  uint8_t extended_checksum;
+  char reserved[3];
+
+  bool IsValid() const;
+} __attribute__((packed));
+
+struct DescriptionHeader {
+  char signature[4];
+  uint32_t length;
+  uint8_t revision;
+  uint8_t checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  uint32_t oem_revision;
+  uint32_t creator_id;
+  uint32_t creator_revision;
+
+  bool IsValid(const char *expected_signature) const;
+} __attribute__((packed));
+
+struct XSDT {
+  DescriptionHeader header;
+
+  const DescriptionHeader &operator[](size_t i) const;
+  size_t Count() const;
+} __attribute__((packed));
+
+// Multiple APIC Description Table. Its entries list the interrupt controllers, one local APIC per CPU.
+struct MADT {
+  DescriptionHeader header;
+  uint32_t lapic_address;
+  uint32_t flags;
+
+  // Calls f(apic_id) for every enabled processor, the BSP included.
+  template <class F>
+  void ForEachLocalAPIC(F f) const {
+    const auto begin = reinterpret_cast<const uint8_t *>(this) + sizeof(MADT);
+    const auto end = reinterpret_cast<const uint8_t *>(this) + header.length;
+    // an entry must fit in the table before any of its fields is read
+    for (auto p = begin; p + 2 <= end && p[1] >= 2 && p + p[1] <= end; p += p[1]) {
+      if (p[0] != kProcessorLocalAPIC || p[1] < 8) {
+        continue;
+      }
+      const auto flags = p[4] | p[5] << 8 | p[6] << 16 | p[7] << 24;
+      if (flags & kEnabled) {
+        f(p[3]);
+      }
+    }
+  }
+
+private:
+  static const uint8_t kProcessorLocalAPIC = 0;
+  static const uint32_t kEnabled = 1;
+} __attribute__((packed));
+
+// Fixed ACPI Description Table; only the power management timer is used.
+struct FADT {
+  DescriptionHeader header;
+  char reserved1[76 - sizeof(header)];
+  uint32_t pm_tmr_blk;
+  char reserved2[112 - 80];
+  uint32_t flags;
+  char reserved3[276 - 116];
+
+  // the PM timer counts 32 bits instead of 24
+  static const uint32_t kTmrValExt = 1u << 8;
+} __attribute__((packed));
+
+// nullptr when the firmware provides no valid MADT
+extern const MADT *madt;
+// nullptr when there is no valid FADT or it has no PM timer
+extern const FADT *fadt;
+
+const unsigned long kPMTimerFreq = 3579545;
+
+// Busy-waits on the PM timer, which needs fadt. msec must stay below 4 seconds (the 24-bit timer wraps after that).
+void WaitMilliseconds(unsigned long msec);
+
+// rsdp is nullptr when the firmware has no ACPI 2.0 table; madt and fadt then stay nullptr.
+void Initialize(const RSDP *rsdp);
+
+} // namespace acpi
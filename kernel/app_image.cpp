@@ -0,0 +1,179 @@
+#include "app_image.hpp"
+#include "elf.hpp"
+#include "spinlock.hpp"
+#include <algorithm>
+#include <memory>
+#include <string.h>
+
+namespace {
+const size_t kMaxAppImages = 8;
+const uint64_t kPageBytes = 4096;
+
+std::vector<std::unique_ptr<AppImage>> images;
+uint64_t use_count;
+size_t cache_hits, cache_misses, frames_saved;
+SpinLock images_lock;
+
+bool Overlaps(const Elf64_Phdr &phdr, uint64_t page) {
+  return phdr.p_vaddr < page + kPageBytes && page < phdr.p_vaddr + phdr.p_memsz;
+}
+
+// Pages shared with a writable segment are left to the page fault handler, which gives each launch its own copy.
+Error BuildSharedPages(AppImage &image) {
+  const auto ehdr = reinterpret_cast<Elf64_Ehdr *>(&image.file_buf[0]);
+  const auto phdr_begin = reinterpret_cast<Elf64_Phdr *>(&image.file_buf[ehdr->e_phoff]);
+  const auto phdr_end = phdr_begin + ehdr->e_phnum;
+  auto is_shareable = [&](uint64_t page) {
+    return std::none_of(phdr_begin, phdr_end, [&](const Elf64_Phdr &phdr) {
+             return phdr.p_type == PT_LOAD && (phdr.p_flags & PF_W) && Overlaps(phdr, page);
+           }) &&
+           std::none_of(image.shared_pages.begin(), image.shared_pages.end(), [&](const auto &shared) {
+             return shared.first == page;
+           });
+  };
+
+  for (auto phdr = phdr_begin; phdr != phdr_end; ++phdr) {
+    if (phdr->p_type != PT_LOAD || (phdr->p_flags & PF_W)) {
+      continue;
+    }
+
+    for (uint64_t page = phdr->p_vaddr & ~(kPageBytes - 1); page < phdr->p_vaddr + phdr->p_memsz; page += kPageBytes) {
+      if (!is_shareable(page)) {
+        continue;
+      }
+
+      auto frame = AllocateZeroedFrame();
+      if (frame.error) {
+        return frame.error;
+      }
+      image.shared_pages.push_back({page, frame.value});
+
+      const auto dst = reinterpret_cast<uint8_t *>(frame.value.Frame());
+      for (auto src = phdr_begin; src != phdr_end; ++src) {
+        if (src->p_type != PT_LOAD || !Overlaps(*src, page)) {
+          continue;
+        }
+        const auto copy_begin = std::max(page, src->p_vaddr);
+        const auto copy_end = std::min(page + kPageBytes, src->p_vaddr + src->p_filesz);
+        if (copy_begin < copy_end) {
+          memcpy(dst + (copy_begin - page), &image.file_buf[src->p_offset + (copy_begin - src->p_vaddr)], copy_end - copy_begin);
+        }
+      }
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void FreeImage(AppImage &image) {
+  for (const auto &[vaddr, frame] : image.shared_pages) {
+    memory_manager->Free(frame, 1);
+  }
+  image.shared_pages.clear();
+}
+
+// called with images_lock held; counts a use of the cached image of file_entry, if there is one
+AppImage *UseCachedImage(const fat::DirectoryEntry &file_entry) {
+  auto it = std::find_if(images.begin(), images.end(), [&](const auto &image) {
+    return image->entry == &file_entry &&
+           image->first_cluster == file_entry.FirstCluster() &&
+           image->file_size == file_entry.file_size;
+  });
+  if (it == images.end()) {
+    return nullptr;
+  }
+
+  auto &image = **it;
+  ++image.users;
+  image.last_used = ++use_count;
+  frames_saved += image.shared_pages.size();
+  return &image;
+}
+
+// drops stale copies of file_entry and, while the cache is full, the least recently used image nobody runs
+void EvictImages(const fat::DirectoryEntry &file_entry) {
+  auto evict = [](auto it) {
+    FreeImage(**it);
+    return images.erase(it);
+  };
+
+  for (auto it = images.begin(); it != images.end();) {
+    it = (*it)->users == 0 && (*it)->entry == &file_entry ? evict(it) : it + 1;
+  }
+
+  while (images.size() >= kMaxAppImages) {
+    auto lru = images.end();
+    for (auto it = images.begin(); it != images.end(); ++it) {
+      if ((*it)->users == 0 && (lru == images.end() || (*it)->last_used < (*lru)->last_used)) {
+        lru = it;
+      }
+    }
+    if (lru == images.end()) {
+      break;
+    }
+    evict(lru);
+  }
+}
+} // namespace
+
+// The file is read and its pages are built without the lock, which masks interrupts.
+// Two CPUs missing on the same app at once both load it, and the later one throws its copy away.
+WithError<AppImage *> AcquireAppImage(const fat::DirectoryEntry &file_entry) {
+  images_lock.Lock();
+  if (auto image = UseCachedImage(file_entry)) {
+    ++cache_hits;
+    images_lock.Unlock();
+    return {image, MAKE_ERROR(Error::kSuccess)};
+  }
+  ++cache_misses;
+  images_lock.Unlock();
+
+  if (file_entry.file_size < sizeof(Elf64_Ehdr)) {
+    return {nullptr, MAKE_ERROR(Error::kInvalidFormat)};
+  }
+
+  auto image = std::make_unique<AppImage>();
+  image->entry = &file_entry;
+  image->first_cluster = file_entry.FirstCluster();
+  image->file_size = file_entry.file_size;
+  image->file_buf.resize(file_entry.file_size);
+  fat::LoadFile(&image->file_buf[0], image->file_buf.size(), file_entry);
+
+  if (memcmp(&image->file_buf[0], "\x7f"
+                                  "ELF",
+             4) != 0) {
+    return {nullptr, MAKE_ERROR(Error::kInvalidFormat)};
+  }
+
+  if (auto err = BuildSharedPages(*image)) {
+    FreeImage(*image);
+    return {nullptr, err};
+  }
+
+  images_lock.Lock();
+  if (auto cached = UseCachedImage(file_entry)) {
+    images_lock.Unlock();
+    FreeImage(*image);
+    return {cached, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  EvictImages(file_entry);
+  image->users = 1;
+  image->last_used = ++use_count;
+  auto result = images.emplace_back(std::move(image)).get();
+  images_lock.Unlock();
+  return {result, MAKE_ERROR(Error::kSuccess)};
+}
+
+void ReleaseAppImage(AppImage *image) {
+  SpinLockGuard guard{images_lock};
+  --image->users;
+}
+
+AppCacheStats GetAppCacheStats() {
+  SpinLockGuard guard{images_lock};
+  size_t shared_frames = 0;
+  for (const auto &image : images) {
+    shared_frames += image->shared_pages.size();
+  }
+  return {images.size(), shared_frames, cache_hits, cache_misses, frames_saved};
+}
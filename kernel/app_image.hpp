@@ -0,0 +1,28 @@
+#pragma once
+
+#include "error.hpp"
+#include "fat.hpp"
+#include "memory_manager.hpp"
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// An app file kept in memory across launches. Pages covered only by read-only
+// segments are built once and mapped into every launch instead of being copied.
+struct AppImage {
+  const fat::DirectoryEntry *entry;
+  uint32_t first_cluster, file_size;
+  std::vector<uint8_t> file_buf;
+  std::vector<std::pair<uint64_t, FrameID>> shared_pages;
+  int users;
+  uint64_t last_used;
+};
+
+// Each successful call must be paired with ReleaseAppImage once the app has exited.
+WithError<AppImage *> AcquireAppImage(const fat::DirectoryEntry &file_entry);
+void ReleaseAppImage(AppImage *image);
+
+struct AppCacheStats {
+  size_t images, shared_frames, hits, misses, frames_saved;
+};
+AppCacheStats GetAppCacheStats();
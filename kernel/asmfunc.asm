@@ -14,6 +14,12 @@ Outb:
   out dx, al
   ret
 
+global Inl
+Inl:
+  mov dx, di
+  in eax, dx
+  ret
+
 global LoadIDT
 LoadIDT:
   push rbp
@@ -65,6 +71,11 @@ SetCSSS:
   pop rbp
   ret
 
+global GetCR2
+GetCR2:
+  mov rax, cr2
+  ret
+
 global GetCR3
 GetCR3:
   mov rax, cr3
@@ -75,6 +86,21 @@ SetCR3:
   mov cr3, rdi
   ret
 
+global GetCR4
+GetCR4:
+  mov rax, cr4
+  ret
+
+global SetCR4
+SetCR4:
+  mov cr4, rdi
+  ret
+
+global InvalidateTLB
+InvalidateTLB:
+  invlpg [rdi]
+  ret
+
 global SwitchContext
 SwitchContext:
   mov [rsi + 0x40], rax
@@ -116,6 +142,8 @@ SwitchContext:
   fxsave [rsi + 0xc0]
   ; fall through to RestoreContext
 
+extern cr3_no_flush_mask
+
 global RestoreContext
 RestoreContext:
   push qword [rdi + 0x28]
@@ -127,6 +155,7 @@ RestoreContext:
   fxrstor [rdi + 0xc0]
 
   mov rax, [rdi + 0x00]
+  or rax, [rel cr3_no_flush_mask]
   mov cr3, rax
   mov rax, [rdi + 0x30]
   mov fs, ax
@@ -170,9 +199,13 @@ CallApp:
   o64 retf
 
 extern LAPICTimerOnInterrupt
+extern WakeupOnInterrupt
 
-global IntHandlerLAPICTimer
-IntHandlerLAPICTimer:
+; Saves the interrupted context as a TaskContext on the stack and passes it to %2,
+; which may switch tasks from there.
+%macro INTERRUPT_WITH_CONTEXT 2
+global %1
+%1:
   push rbp
   mov rbp, rsp
 
@@ -209,7 +242,7 @@ IntHandlerLAPICTimer:
   push rcx
 
   mov rdi, rsp
-  call LAPICTimerOnInterrupt
+  call %2
   add rsp, 8*8
   pop rax
   pop rbx
@@ -231,6 +264,25 @@ IntHandlerLAPICTimer:
   mov rsp, rbp
   pop rbp
   iretq
+%endmacro
+
+INTERRUPT_WITH_CONTEXT IntHandlerLAPICTimer, LAPICTimerOnInterrupt
+INTERRUPT_WITH_CONTEXT IntHandlerWakeup, WakeupOnInterrupt
+
+global ReadTSC
+ReadTSC:
+  rdtsc
+  shl rdx, 32
+  or rax, rdx
+  ret
+
+global ReadMSR
+ReadMSR:
+  mov ecx, edi
+  rdmsr
+  shl rdx, 32
+  or rax, rdx
+  ret
 
 global WriteMSR
 WriteMSR:
@@ -305,3 +357,84 @@ KernelMain:
 .fin:
   hlt
   jmp .fin
+
+; The APs start here in real mode at a page below 1 MiB that StartAPs copies this code to.
+; Everything is addressed relative to that page, whose address is kept in ebx/rbx.
+bits 16
+global APBootStart
+APBootStart:
+  cli
+  mov ax, cs
+  mov ds, ax
+  xor ebx, ebx
+  mov bx, ax
+  shl ebx, 4
+
+  lea eax, [ebx + ap_gdt - APBootStart]
+  mov [ap_gdt_ptr - APBootStart + 2], eax
+  lea eax, [ebx + ap_protected_mode - APBootStart]
+  mov [ap_protected_mode_jump - APBootStart], eax
+  lea eax, [ebx + ap_long_mode - APBootStart]
+  mov [ap_long_mode_jump - APBootStart], eax
+
+  lgdt [ap_gdt_ptr - APBootStart]
+  mov eax, cr0
+  and eax, ~0x60000000 ; CD and NW, which INIT leaves set
+  or eax, 1 ; PE
+  mov cr0, eax
+  o32 jmp far [ap_protected_mode_jump - APBootStart]
+
+bits 32
+ap_protected_mode:
+  mov ax, 0x10
+  mov ds, ax
+  mov es, ax
+  mov ss, ax
+
+  mov eax, cr4
+  or eax, (1 << 5) | (1 << 9) | (1 << 10) ; PAE, and OSFXSR and OSXMMEXCPT as the firmware set them on the BSP
+  mov cr4, eax
+  mov eax, [ebx + ap_cr3 - APBootStart]
+  mov cr3, eax
+  mov ecx, 0xc0000080 ; IA32_EFER
+  rdmsr
+  or eax, 1 << 8 ; LME
+  wrmsr
+  mov eax, cr0
+  and eax, ~(1 << 2) ; EM
+  or eax, (1 << 31) | (1 << 1) ; PG and MP
+  mov cr0, eax
+  jmp far [ebx + ap_long_mode_jump - APBootStart]
+
+bits 64
+ap_long_mode:
+  mov ebx, ebx
+  mov rsp, [rbx + ap_stack - APBootStart]
+  jmp [rbx + ap_entry - APBootStart]
+
+align 8
+ap_gdt:
+  dq 0
+  dq 0x00cf9a000000ffff ; 32-bit code
+  dq 0x00cf92000000ffff ; data
+  dq 0x00af9a000000ffff ; 64-bit code
+ap_gdt_ptr:
+  dw 4 * 8 - 1
+  dd 0
+ap_protected_mode_jump:
+  dd 0
+  dw 0x08
+ap_long_mode_jump:
+  dd 0
+  dw 0x18
+
+; APBootData in smp.cpp
+align 8
+ap_cr3:
+  dq 0
+ap_stack:
+  dq 0
+ap_entry:
+  dq 0
+global APBootEnd
+APBootEnd:
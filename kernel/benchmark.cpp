@@ -0,0 +1,786 @@
+#include "benchmark.hpp"
+#include "asmfunc.hpp"
+#include "console.hpp"
+#include "graphics.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+#include "terminal.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <array>
+#include <string.h>
+#include <vector>
+
+namespace {
+struct BootPhase {
+  const char *name;
+  uint64_t tsc;
+};
+
+std::array<BootPhase, 16> boot_phases;
+size_t num_boot_phases = 0;
+
+struct FrameRange {
+  size_t start;
+  size_t num_frames;
+};
+
+void FreeAll(std::vector<FrameRange> &ranges) {
+  for (auto &r : ranges) {
+    memory_manager->Free(FrameID{r.start}, r.num_frames);
+  }
+  ranges.clear();
+}
+
+// returns the average cycles of one Allocate(num_frames) call, or 0 if memory ran out
+uint64_t MeasureAllocate(size_t num_frames, size_t num_calls) {
+  std::vector<FrameRange> allocated;
+  allocated.reserve(num_calls);
+
+  uint64_t cycles = 0;
+  for (size_t i = 0; i < num_calls; ++i) {
+    const auto begin = ReadTSC();
+    auto [frame, err] = memory_manager->Allocate(num_frames);
+    cycles += ReadTSC() - begin;
+    if (err) {
+      FreeAll(allocated);
+      return 0;
+    }
+    allocated.push_back({frame.ID(), num_frames});
+  }
+
+  FreeAll(allocated);
+  return cycles / num_calls;
+}
+
+void BenchmarkFrameAllocation(FileDescriptor &out) {
+  const size_t kNumCalls = 256;
+  const size_t kMultiFrames = 16;
+  const size_t kFillFrames = 64_MiB / kBytesPerFrame;
+
+  std::vector<FrameRange> fill;
+  PrintToFD(out, "filled[MiB] 1-frame[cycles] %lu-frame[cycles]\n", kMultiFrames);
+  while (true) {
+    const auto single = MeasureAllocate(1, kNumCalls);
+    const auto multi = MeasureAllocate(kMultiFrames, kNumCalls);
+    PrintToFD(out, "%11lu %15lu %16lu\n", fill.size() * 64, single, multi);
+    if (single == 0 || multi == 0) {
+      break;
+    }
+
+    auto [frame, err] = memory_manager->Allocate(kFillFrames);
+    if (err) {
+      break;
+    }
+    fill.push_back({frame.ID(), kFillFrames});
+  }
+
+  FreeAll(fill);
+}
+
+// the frame-by-frame next-fit search BitmapMemoryManager used before it had a line summary
+class FlatFrameAllocator {
+public:
+  FlatFrameAllocator(size_t begin, size_t end) : allocated_(end, false), begin_{begin}, end_{end}, next_{begin} {}
+
+  long Allocate(size_t num_frames) {
+    const size_t hint = std::max(next_, begin_);
+    long start = Find(hint, end_, num_frames);
+    if (start < 0) {
+      start = Find(begin_, std::min(hint + num_frames - 1, end_), num_frames);
+    }
+    if (start < 0) {
+      return -1;
+    }
+    Mark(start, num_frames, true);
+    next_ = start + num_frames;
+    return start;
+  }
+
+  void Mark(size_t start, size_t num_frames, bool allocated) {
+    for (size_t i = 0; i < num_frames; ++i) {
+      allocated_[start + i] = allocated;
+    }
+  }
+
+private:
+  std::vector<bool> allocated_;
+  size_t begin_, end_, next_;
+
+  long Find(size_t begin, size_t end, size_t num_frames) const {
+    for (size_t start = begin; start + num_frames <= end; ++start) {
+      size_t i = 0;
+      for (; i < num_frames; ++i) {
+        if (allocated_[start + i]) {
+          break;
+        }
+      }
+      if (i == num_frames) {
+        return start;
+      }
+      start += i;
+    }
+    return -1;
+  }
+};
+
+uint64_t NextRandom(uint64_t &state) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+// runs the same random Allocate/Free sequence on a private BitmapMemoryManager and on the
+// flat allocator, and checks that both hand out the same frames
+void BenchmarkFrameStress(FileDescriptor &out) {
+  const size_t kNumFrames = 4_GiB / kBytesPerFrame;
+  const int kNumOps = 100000;
+
+  std::vector<uint8_t> metadata(BitmapMemoryManager::MetadataBytes(kNumFrames));
+  auto manager = new BitmapMemoryManager{&metadata[0], kNumFrames};
+  FlatFrameAllocator flat{1, kNumFrames};
+  uint64_t rand = 88172645463325252ull;
+
+  for (size_t frame = 0; frame < kNumFrames; frame += 1 + NextRandom(rand) % 1024) {
+    const size_t num_frames = std::min<size_t>(NextRandom(rand) % 256, kNumFrames - frame);
+    manager->MarkAllocated(FrameID{frame}, num_frames);
+    flat.Mark(frame, num_frames, true);
+  }
+  manager->SetMemoryRange(FrameID{1}, FrameID{kNumFrames});
+
+  std::vector<FrameRange> live;
+  uint64_t summary_cycles = 0, flat_cycles = 0;
+  int num_allocs = 0;
+  bool failed = false;
+  for (int op = 0; op < kNumOps; ++op) {
+    if (!live.empty() && NextRandom(rand) % 2 == 0) {
+      const size_t i = NextRandom(rand) % live.size();
+      const auto r = live[i];
+      live[i] = live.back();
+      live.pop_back();
+      manager->Free(FrameID{r.start}, r.num_frames);
+      flat.Mark(r.start, r.num_frames, false);
+      continue;
+    }
+
+    const uint64_t kind = NextRandom(rand) % 8;
+    const size_t num_frames = kind < 4 ? 1 : kind < 7 ? 1 + NextRandom(rand) % 64 : 1 + NextRandom(rand) % 4096;
+
+    auto begin = ReadTSC();
+    const auto [frame, err] = manager->Allocate(num_frames);
+    summary_cycles += ReadTSC() - begin;
+
+    begin = ReadTSC();
+    const long expected = flat.Allocate(num_frames);
+    flat_cycles += ReadTSC() - begin;
+
+    ++num_allocs;
+    const long actual = err ? -1 : static_cast<long>(frame.ID());
+    if (actual != expected) {
+      PrintToFD(out, "mismatch: op=%d frames=%lu summary=%ld flat=%ld\n", op, num_frames, actual, expected);
+      failed = true;
+      break;
+    }
+    if (expected >= 0) {
+      live.push_back({static_cast<size_t>(expected), num_frames});
+    }
+  }
+
+  PrintToFD(out, "%s after %d allocations\n", failed ? "FAILED" : "OK", num_allocs);
+  PrintToFD(out, "summary: %lu cycles/alloc, flat: %lu cycles/alloc\n",
+            summary_cycles / num_allocs, flat_cycles / num_allocs);
+  delete manager;
+}
+
+// largest power-of-two number of frames memory_manager can hand out in one piece
+size_t LargestAllocatable() {
+  for (size_t num_frames = 64_MiB / kBytesPerFrame; num_frames > 0; num_frames /= 2) {
+    if (auto [frame, err] = memory_manager->Allocate(num_frames); !err) {
+      memory_manager->Free(frame, num_frames);
+      return num_frames;
+    }
+  }
+  return 0;
+}
+
+// mimics the frame traffic of loading and unloading apps: single-frame page tables and data pages
+// freed one by one, with an occasional long-lived kernel allocation left behind
+void BenchmarkAppCycles(FileDescriptor &out) {
+  const int kNumCycles = 2000;
+  const int kLongLivedInterval = 16;
+
+  std::vector<FrameRange> app, long_lived;
+  uint64_t rand = 2463534242ull;
+  uint64_t alloc_cycles = 0, free_cycles = 0, num_ops = 0;
+
+  PrintToFD(out, "largest block before: %lu frames\n", LargestAllocatable());
+  for (int cycle = 0; cycle < kNumCycles; ++cycle) {
+    const size_t num_pages = 8 + NextRandom(rand) % 256;
+    for (size_t i = 0; i < num_pages; ++i) {
+      const auto begin = ReadTSC();
+      auto [frame, err] = memory_manager->Allocate(1);
+      alloc_cycles += ReadTSC() - begin;
+      if (err) {
+        break;
+      }
+      app.push_back({frame.ID(), 1});
+      ++num_ops;
+    }
+
+    if (cycle % kLongLivedInterval == 0) {
+      if (auto [frame, err] = memory_manager->Allocate(1); !err) {
+        long_lived.push_back({frame.ID(), 1});
+      }
+    }
+
+    for (auto &r : app) {
+      const auto begin = ReadTSC();
+      memory_manager->Free(FrameID{r.start}, r.num_frames);
+      free_cycles += ReadTSC() - begin;
+    }
+    app.clear();
+  }
+
+  PrintToFD(out, "largest block after %d cycles: %lu frames\n", kNumCycles, LargestAllocatable());
+  PrintToFD(out, "alloc: %lu cycles/frame, free: %lu cycles/frame\n", alloc_cycles / num_ops, free_cycles / num_ops);
+  FreeAll(long_lived);
+}
+
+void BenchmarkBoot(FileDescriptor &out) {
+  if (num_boot_phases == 0) {
+    return;
+  }
+
+  for (size_t i = 1; i < num_boot_phases; ++i) {
+    PrintToFD(out, "%-16s %12lu cycles\n", boot_phases[i].name, boot_phases[i].tsc - boot_phases[i - 1].tsc);
+  }
+  PrintToFD(out, "%-16s %12lu cycles\n", "total", boot_phases[num_boot_phases - 1].tsc - boot_phases[0].tsc);
+}
+
+void ExitImmediately(uint64_t task_id, int64_t data) {
+  __asm__("cli");
+  task_manager->Finish(0);
+}
+
+void BenchmarkSpawn(FileDescriptor &out) {
+  const int kNumTasks = 1000;
+
+  const auto begin = ReadTSC();
+  for (int i = 0; i < kNumTasks; ++i) {
+    __asm__("cli");
+    const auto task_id = task_manager->NewTask().InitContext(ExitImmediately, 0).Wakeup().ID();
+    task_manager->WaitFinish(task_id);
+    __asm__("sti");
+  }
+  PrintToFD(out, "spawn: %lu cycles/task\n", (ReadTSC() - begin) / kNumTasks);
+}
+
+// average cycles of SendMessage to the newest of num_tasks sleeping tasks, the worst case for a linear search
+uint64_t MeasureSendMessage(size_t num_tasks) {
+  // all of them fit in the mailbox, so none takes the drop path
+  const int kNumMessages = MessageRing::kCapacity;
+
+  std::vector<uint64_t> task_ids;
+  for (size_t i = 0; i < num_tasks; ++i) {
+    task_ids.push_back(task_manager->NewTask().InitContext(ExitImmediately, 0).ID());
+  }
+
+  const Message msg{Message::kTimerTimeout};
+  __asm__("cli");
+  const auto begin = ReadTSC();
+  for (int i = 0; i < kNumMessages; ++i) {
+    task_manager->SendMessage(task_ids.back(), msg);
+  }
+  const auto cycles = ReadTSC() - begin;
+
+  for (auto id : task_ids) {
+    task_manager->Wakeup(id);
+  }
+  for (auto id : task_ids) {
+    task_manager->WaitFinish(id);
+  }
+  __asm__("sti");
+  return cycles / kNumMessages;
+}
+
+// average cycles of SendMessage to a task whose mailbox is already full; the task is pinned
+// to this CPU, where interrupts stay masked, so that it cannot run and drain the mailbox
+uint64_t MeasureFullMailbox(size_t &dropped) {
+  const int kNumMessages = MessageRing::kCapacity;
+
+  Task &task = task_manager->NewTask().Pin().InitContext(ExitImmediately, 0);
+  const Message msg{Message::kTimerTimeout};
+  __asm__("cli");
+  for (int i = 0; i < kNumMessages; ++i) {
+    task_manager->SendMessage(task.ID(), msg);
+  }
+  const auto begin = ReadTSC();
+  for (int i = 0; i < kNumMessages; ++i) {
+    task_manager->SendMessage(task.ID(), msg);
+  }
+  const auto cycles = ReadTSC() - begin;
+  dropped = task.DroppedMessages();
+
+  task_manager->WaitFinish(task.ID());
+  __asm__("sti");
+  return cycles / kNumMessages;
+}
+
+void BenchmarkTasks(FileDescriptor &out) {
+  for (size_t num_tasks = 16; num_tasks <= 4096; num_tasks *= 4) {
+    PrintToFD(out, "%5lu tasks: %lu cycles/message\n", num_tasks, MeasureSendMessage(num_tasks));
+  }
+  size_t dropped;
+  const auto cycles = MeasureFullMailbox(dropped);
+  PrintToFD(out, "full mailbox: %lu cycles/message, %lu of %lu dropped\n", cycles, dropped, MessageRing::kCapacity);
+}
+
+// Average cycles of a Sleep and a Wakeup at a random level, on a private TaskManager whose num_tasks runnable
+// tasks spread over all levels. Nothing is ever switched to there, so the pair only moves a task between queues.
+uint64_t MeasureRunQueues(size_t num_tasks) {
+  const int kNumOps = 10'000;
+
+  std::unique_ptr<TaskManager> tasks{new TaskManager};
+  std::vector<uint64_t> task_ids;
+  for (size_t i = 0; i < num_tasks; ++i) {
+    task_ids.push_back(tasks->NewTask().ID());
+    tasks->Wakeup(task_ids.back(), i % (TaskManager::kMaxLevel + 1));
+  }
+
+  uint64_t rand = 2463534242ull;
+  const auto begin = ReadTSC();
+  for (int i = 0; i < kNumOps; ++i) {
+    const auto id = task_ids[NextRandom(rand) % num_tasks];
+    tasks->Sleep(id);
+    tasks->Wakeup(id, NextRandom(rand) % (TaskManager::kMaxLevel + 1));
+  }
+  return (ReadTSC() - begin) / kNumOps;
+}
+
+void BenchmarkRunQueues(FileDescriptor &out) {
+  for (size_t num_tasks = 16; num_tasks <= 4096; num_tasks *= 4) {
+    PrintToFD(out, "%5lu tasks: %lu cycles/sleep+wakeup\n", num_tasks, MeasureRunQueues(num_tasks));
+  }
+}
+
+void DrainPipe(uint64_t task_id, int64_t data) {
+  auto pipe = reinterpret_cast<PipeDescriptor *>(data);
+  char buf[64];
+  while (pipe->Read(buf, sizeof(buf)) > 0) {
+  }
+
+  __asm__("cli");
+  task_manager->Finish(0);
+}
+
+void BenchmarkPipe(FileDescriptor &out) {
+  const size_t kNumBytes = 1_MiB;
+
+  auto &reader = task_manager->NewTask();
+  const auto reader_id = reader.ID();
+  auto pipe = MakeShared<PipeDescriptor>(reader);
+  reader.InitContext(DrainPipe, reinterpret_cast<int64_t>(pipe.get())).Wakeup();
+
+  char buf[256];
+  memset(buf, 'x', sizeof(buf));
+  const auto begin = ReadTSC();
+  for (size_t sent = 0; sent < kNumBytes; sent += sizeof(buf)) {
+    pipe->Write(buf, sizeof(buf));
+  }
+  pipe->FinishWrite();
+
+  __asm__("cli");
+  task_manager->WaitFinish(reader_id);
+  __asm__("sti");
+  PrintToFD(out, "pipe: %lu cycles/KiB\n", (ReadTSC() - begin) / (kNumBytes / 1_KiB));
+}
+
+struct PingPong {
+  std::array<uint64_t, 2> task_ids;
+  int num_rounds;
+};
+
+// Each private page map has pages of its own here, where apps are loaded. They are not global,
+// unlike the identity map, so their TLB entries survive a switch only when the PCID keeps them.
+const uint64_t kTouchAddr = 0xffff'8000'0000'0000;
+const size_t kTouchPages = 16;
+
+// touches one byte in each page at kTouchAddr, then hands the CPU over to the other task
+void PingPongTask(uint64_t task_id, int64_t data) {
+  auto &pp = *reinterpret_cast<PingPong *>(data);
+  const auto peer = pp.task_ids[0] == task_id ? pp.task_ids[1] : pp.task_ids[0];
+  const auto buf = reinterpret_cast<const volatile uint8_t *>(kTouchAddr);
+  for (int i = 0; i < pp.num_rounds; ++i) {
+    for (size_t page = 0; page < kTouchPages; ++page) {
+      (void)buf[page * kBytesPerFrame];
+    }
+    __asm__("cli");
+    task_manager->Wakeup(peer);
+    task_manager->Sleep(task_id);
+    __asm__("sti");
+  }
+
+  __asm__("cli");
+  task_manager->Wakeup(peer);
+  task_manager->Finish(0);
+}
+
+// a page map of its own that shares the kernel half, as apps get from SetupPML4, with kTouchPages mapped
+WithError<uint64_t> NewKernelCR3() {
+  auto [pml4, err] = NewPageMap();
+  if (err) {
+    return {0, err};
+  }
+  auto [pcid, pcid_err] = AllocatePCID();
+  if (pcid_err) {
+    FreePageMap(pml4);
+    return {0, pcid_err};
+  }
+  memcpy(pml4, CurrentPML4(), 256 * sizeof(uint64_t));
+
+  // drop whatever the previous owner of pcid left in the TLB
+  const auto cr3 = reinterpret_cast<uint64_t>(pml4) | pcid;
+  const auto current_cr3 = GetCR3();
+  SetCR3(cr3);
+  auto setup_err = SetupPageMaps(LinearAddress4Level{kTouchAddr}, kTouchPages);
+  if (setup_err) {
+    CleanPageMaps(LinearAddress4Level{kTouchAddr});
+  }
+  SetCR3(current_cr3 | cr3_no_flush_mask);
+  if (setup_err) {
+    FreePCID(pcid);
+    memset(pml4, 0, kBytesPerFrame);
+    FreePageMap(pml4);
+    return {0, setup_err};
+  }
+  return {cr3, MAKE_ERROR(Error::kSuccess)};
+}
+
+void FreeKernelCR3(uint64_t cr3) {
+  const auto current_cr3 = GetCR3();
+  SetCR3(cr3 | cr3_no_flush_mask);
+  CleanPageMaps(LinearAddress4Level{kTouchAddr});
+  SetCR3(current_cr3 | cr3_no_flush_mask);
+
+  FreePCID(cr3 & 0xfff);
+  const auto pml4 = reinterpret_cast<PageMapEntry *>(cr3 & ~static_cast<uint64_t>(0xfff));
+  memset(pml4, 0, kBytesPerFrame);
+  FreePageMap(pml4);
+}
+
+// average cycles per switch between two tasks with separate page maps, both pinned to this CPU
+// so that every switch is a CR3 load rather than an IPI to the other task's CPU
+uint64_t MeasureSwitches(PingPong &pp, const std::array<uint64_t, 2> &cr3s) {
+  const auto begin = ReadTSC();
+  __asm__("cli");
+  std::array<Task *, 2> tasks{&task_manager->NewTask().Pin(), &task_manager->NewTask().Pin()};
+  for (int i = 0; i < 2; ++i) {
+    pp.task_ids[i] = tasks[i]->ID();
+  }
+  for (int i = 0; i < 2; ++i) {
+    tasks[i]->InitContext(PingPongTask, reinterpret_cast<int64_t>(&pp));
+    tasks[i]->Context().cr3 = cr3s[i];
+    tasks[i]->Wakeup();
+  }
+  for (auto id : pp.task_ids) {
+    task_manager->WaitFinish(id);
+  }
+  __asm__("sti");
+  return (ReadTSC() - begin) / (2 * pp.num_rounds);
+}
+
+void BenchmarkContextSwitch(FileDescriptor &out) {
+  const int kNumRounds = 10000;
+
+  std::array<uint64_t, 2> cr3s{};
+  for (auto &cr3 : cr3s) {
+    if (auto [value, cr3_err] = NewKernelCR3(); !cr3_err) {
+      cr3 = value;
+    }
+  }
+
+  if (cr3s[0] != 0 && cr3s[1] != 0) {
+    PingPong pp{{}, kNumRounds};
+    const auto no_flush_mask = cr3_no_flush_mask;
+    cr3_no_flush_mask = 0;
+    PrintToFD(out, "flush:    %lu cycles/switch\n", MeasureSwitches(pp, cr3s));
+    cr3_no_flush_mask = no_flush_mask;
+    if (no_flush_mask != 0) {
+      PrintToFD(out, "no-flush: %lu cycles/switch\n", MeasureSwitches(pp, cr3s));
+    } else {
+      PrintToFD(out, "no-flush: PCID not enabled\n");
+    }
+  } else {
+    PrintToFD(out, "failed to set up page maps\n");
+  }
+
+  for (auto cr3 : cr3s) {
+    if (cr3 != 0) {
+      FreeKernelCR3(cr3);
+    }
+  }
+}
+
+// average cycles to touch one byte in each 2 MiB region of buf right after a CR3 reload
+uint64_t MeasureRegionTouches(const volatile uint8_t *buf, size_t num_regions) {
+  const int kNumRounds = 64;
+
+  uint64_t cycles = 0;
+  for (int round = 0; round < kNumRounds; ++round) {
+    SetCR3(GetCR3());
+    const auto begin = ReadTSC();
+    for (size_t region = 0; region < num_regions; ++region) {
+      (void)buf[region * 2_MiB + region % 64 * 64];
+    }
+    cycles += ReadTSC() - begin;
+  }
+  return cycles / (kNumRounds * num_regions);
+}
+
+void BenchmarkTLB(FileDescriptor &out) {
+  const uint64_t kCR4PGE = 1u << 7;
+
+  size_t num_frames = 1_GiB / kBytesPerFrame;
+  auto frame = kNullFrame;
+  for (; num_frames >= 2_MiB / kBytesPerFrame; num_frames /= 2) {
+    if (auto [f, err] = memory_manager->Allocate(num_frames); !err) {
+      frame = f;
+      break;
+    }
+  }
+  if (frame.ID() == kNullFrame.ID()) {
+    PrintToFD(out, "failed to allocate the touch buffer\n");
+    return;
+  }
+
+  const auto buf = reinterpret_cast<const volatile uint8_t *>(frame.Frame());
+  const size_t num_regions = num_frames * kBytesPerFrame / 2_MiB;
+  PrintToFD(out, "identity map: %lu MiB pages, %lu regions\n", IdentityPageBytes() / 1_MiB, num_regions);
+
+  // CR4 is per CPU, so both runs and the restore stay on this one with nothing else scheduled in between
+  __asm__("cli");
+  const auto cr4 = GetCR4();
+  const auto global = MeasureRegionTouches(buf, num_regions);
+  SetCR4(cr4 & ~kCR4PGE);
+  const auto non_global = MeasureRegionTouches(buf, num_regions);
+  SetCR4(cr4);
+  __asm__("sti");
+  PrintToFD(out, "global:     %lu cycles/touch\n", global);
+  PrintToFD(out, "non-global: %lu cycles/touch\n", non_global);
+
+  memory_manager->Free(frame, num_frames);
+}
+
+// full-screen clears and console scrolls, which between them cover most framebuffer traffic
+void MeasureFrames(uint64_t &clear_cycles, uint64_t &scroll_cycles) {
+  const int kNumFrames = 32;
+
+  auto begin = ReadTSC();
+  for (int i = 0; i < kNumFrames; ++i) {
+    const uint8_t v = i % 2 ? 0 : 64;
+    pixel_writer->Clear({v, v, v});
+  }
+  clear_cycles = (ReadTSC() - begin) / kNumFrames;
+
+  console->Clear();
+  for (int row = 0; row < Console::kRows; ++row) {
+    console->PutString("scroll\n");
+  }
+  begin = ReadTSC();
+  for (int i = 0; i < kNumFrames; ++i) {
+    console->PutString("scroll\n");
+  }
+  scroll_cycles = (ReadTSC() - begin) / kNumFrames;
+  console->Clear();
+}
+
+void BenchmarkFPS(FileDescriptor &out) {
+  // measuring clears the console, so the results are printed at the end
+  uint64_t wc_clear, wc_scroll, uc_clear, uc_scroll;
+  // The PAT switch reaches only this CPU, so the task must not move, and nothing else may run here
+  // while the framebuffer is uncached. Write-combining is back before interrupts are.
+  __asm__("cli");
+  const bool write_combining = SetFrameBufferWriteCombining(true);
+  if (write_combining) {
+    MeasureFrames(wc_clear, wc_scroll);
+    SetFrameBufferWriteCombining(false);
+  }
+  MeasureFrames(uc_clear, uc_scroll);
+  SetFrameBufferWriteCombining(write_combining);
+  __asm__("sti");
+
+  if (write_combining) {
+    PrintToFD(out, "write-combining: %lu cycles/clear, %lu cycles/scroll\n", wc_clear, wc_scroll);
+  } else {
+    PrintToFD(out, "framebuffer is not mapped through the PAT\n");
+  }
+  PrintToFD(out, "uncached:        %lu cycles/clear, %lu cycles/scroll\n", uc_clear, uc_scroll);
+}
+
+class DiscardFileDescriptor : public FileDescriptor {
+public:
+  size_t Read(void *buf, size_t len) override { return 0; }
+  size_t Write(const void *buf, size_t len) override { return len; }
+};
+
+// runs 'rpn 1 2 +' back to back; every launch builds and tears down a whole address space
+void BenchmarkLaunch(FileDescriptor &out) {
+  const int kNumLaunches = 1000;
+
+  auto [file_entry, post_slash] = fat::FindFile("rpn");
+  if (!file_entry) {
+    PrintToFD(out, "rpn not found\n");
+    return;
+  }
+
+  std::shared_ptr<FileDescriptor> discard = MakeShared<DiscardFileDescriptor>();
+  const auto maps_before = GetPageMapCacheStats();
+  const auto pool_before = GetZeroedPoolStats();
+  const auto begin = ReadTSC();
+  for (int i = 0; i < kNumLaunches; ++i) {
+    char cmd[] = "rpn", arg[] = "1 2 +";
+    if (auto [ec, err] = ExecuteFile(*file_entry, cmd, arg, {discard, discard, discard}); err) {
+      PrintToFD(out, "launch %d failed: %s\n", i, err.Name());
+      return;
+    }
+  }
+  const auto cycles = ReadTSC() - begin;
+  const auto maps = GetPageMapCacheStats();
+  const auto pool = GetZeroedPoolStats();
+
+  PrintToFD(out, "launch: %lu cycles/launch\n", cycles / kNumLaunches);
+  PrintToFD(out, "page map cache: %lu hits, %lu misses\n",
+            maps.hits - maps_before.hits, maps.misses - maps_before.misses);
+  PrintToFD(out, "zeroed pool: %lu hits, %lu misses\n",
+            pool.hits - pool_before.hits, pool.misses - pool_before.misses);
+}
+
+void Spin(uint64_t task_id, int64_t data) {
+  volatile uint64_t sum = 0;
+  for (int64_t i = 0; i < data; ++i) {
+    sum += i;
+  }
+
+  __asm__("cli");
+  task_manager->Finish(0);
+}
+
+// cycles until num_tasks tasks of the same fixed work all finish; they all start on this CPU
+uint64_t MeasureSpinners(int num_tasks, int64_t iterations) {
+  std::vector<uint64_t> task_ids;
+  const auto begin = ReadTSC();
+  __asm__("cli");
+  for (int i = 0; i < num_tasks; ++i) {
+    task_ids.push_back(task_manager->NewTask().InitContext(Spin, iterations).Wakeup().ID());
+  }
+  for (auto id : task_ids) {
+    task_manager->WaitFinish(id);
+  }
+  __asm__("sti");
+  return ReadTSC() - begin;
+}
+
+// throughput of N CPU-bound tasks relative to one; near N up to the number of CPUs when balancing spreads them
+void BenchmarkScaling(FileDescriptor &out) {
+  const int64_t kIterations = 50'000'000;
+
+  const int num_cpus = NumCPUs();
+  PrintToFD(out, "%d CPUs\n", num_cpus);
+  const auto one = MeasureSpinners(1, kIterations);
+  for (int num_tasks = 1; num_tasks <= 2 * num_cpus; num_tasks *= 2) {
+    const auto cycles = num_tasks == 1 ? one : MeasureSpinners(num_tasks, kIterations);
+    const auto speedup = 100 * num_tasks * one / cycles;
+    PrintToFD(out, "%3d tasks: %12lu cycles, %lu.%02lux throughput\n", num_tasks, cycles, speedup / 100, speedup % 100);
+  }
+}
+
+// Fills a private TimerManager with num_timers timers spread over about an hour, none of which comes due
+// during the measured ticks, so the ticks only pay for moving timers down the wheel.
+void MeasureTimers(FileDescriptor &out, int num_timers) {
+  const int kNumTicks = 10'000;
+
+  std::unique_ptr<TimerManager> timers{new TimerManager};
+  std::vector<TimerHandle> handles;
+  handles.reserve(num_timers);
+  uint64_t rand = 88172645463325252ull;
+
+  __asm__("cli");
+  auto begin = ReadTSC();
+  for (int i = 0; i < num_timers; ++i) {
+    const unsigned long timeout = kNumTicks + 1 + NextRandom(rand) % (3600 * kTimerFreq);
+    handles.push_back(timers->AddTimer(Timer{timeout, 0}));
+  }
+  const auto add_cycles = (ReadTSC() - begin) / num_timers;
+
+  uint64_t tick_cycles = 0, max_tick_cycles = 0;
+  for (int i = 0; i < kNumTicks; ++i) {
+    begin = ReadTSC();
+    timers->Tick();
+    const auto cycles = ReadTSC() - begin;
+    tick_cycles += cycles;
+    max_tick_cycles = std::max(max_tick_cycles, cycles);
+  }
+
+  begin = ReadTSC();
+  for (const auto &handle : handles) {
+    timers->CancelTimer(handle);
+  }
+  const auto cancel_cycles = (ReadTSC() - begin) / num_timers;
+  __asm__("sti");
+
+  PrintToFD(out, "%7d timers: add %lu, tick %lu (max %lu), cancel %lu cycles\n",
+            num_timers, add_cycles, tick_cycles / kNumTicks, max_tick_cycles, cancel_cycles);
+}
+
+void BenchmarkTimers(FileDescriptor &out) {
+  for (int num_timers = 100; num_timers <= 100'000; num_timers *= 10) {
+    MeasureTimers(out, num_timers);
+  }
+}
+
+struct Benchmark {
+  const char *name;
+  void (*func)(FileDescriptor &out);
+};
+
+const Benchmark kBenchmarks[] = {
+    {"boot", BenchmarkBoot},
+    {"frame", BenchmarkFrameAllocation},
+    {"frame-stress", BenchmarkFrameStress},
+    {"app-cycles", BenchmarkAppCycles},
+    {"spawn", BenchmarkSpawn},
+    {"tasks", BenchmarkTasks},
+    {"runqueue", BenchmarkRunQueues},
+    {"pipe", BenchmarkPipe},
+    {"ctxswitch", BenchmarkContextSwitch},
+    {"tlb", BenchmarkTLB},
+    {"launch", BenchmarkLaunch},
+    {"fps", BenchmarkFPS},
+    {"scaling", BenchmarkScaling},
+    {"timers", BenchmarkTimers},
+};
+} // namespace
+
+void RecordBootPhase(const char *name) {
+  if (num_boot_phases < boot_phases.size()) {
+    boot_phases[num_boot_phases++] = {name, ReadTSC()};
+  }
+}
+
+void RunBenchmark(const char *name, FileDescriptor &out) {
+  for (const auto &b : kBenchmarks) {
+    if (name && strcmp(name, b.name) == 0) {
+      b.func(out);
+      return;
+    }
+  }
+
+  PrintToFD(out, "usage: bench <name>\n");
+  for (const auto &b : kBenchmarks) {
+    PrintToFD(out, "  %s\n", b.name);
+  }
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "file.hpp"
+
+void RunBenchmark(const char *name, FileDescriptor &out);
+
+// records the TSC at the end of a boot phase; 'bench boot' prints the phases
+void RecordBootPhase(const char *name);
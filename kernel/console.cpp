@@ -8,31 +8,38 @@ Console::Console(PixelWriter &writer, const PixelColor &fg_color, const PixelCol
 }
 
 void Console::PutChar(char c) {
-  if (c == '\n') {
-    NewLine();
-  } else if (c == '\r') {
-    cursor_column_ = 0;
-  } else if (cursor_column_ < kColumns - 1) {
-    WriteAscii(writer_, 8 * cursor_column_, 16 * cursor_row_, c, fg_color_, bg_color_);
-    buffer_[cursor_row_][cursor_column_] = c;
-    ++cursor_column_;
-  }
+  SpinLockGuard guard{lock_};
+  Put(c);
 }
 
 void Console::PutString(const char *s) {
+  SpinLockGuard guard{lock_};
   while (*s) {
-    this->PutChar(*s);
+    Put(*s);
     ++s;
   }
 }
 
 void Console::Clear() {
+  SpinLockGuard guard{lock_};
   writer_.Clear(bg_color_);
   cursor_column_ = 0;
   cursor_row_ = 0;
   memset(buffer_, 0, (kColumns + 1) * kRows);
 }
 
+void Console::Put(char c) {
+  if (c == '\n') {
+    NewLine();
+  } else if (c == '\r') {
+    cursor_column_ = 0;
+  } else if (cursor_column_ < kColumns - 1) {
+    WriteAscii(writer_, 8 * cursor_column_, 16 * cursor_row_, c, fg_color_, bg_color_);
+    buffer_[cursor_row_][cursor_column_] = c;
+    ++cursor_column_;
+  }
+}
+
 void Console::NewLine() {
   cursor_column_ = 0;
   if (cursor_row_ < kRows - 1) {
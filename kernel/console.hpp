@@ -1,6 +1,7 @@
 #pragma once
 
 #include "graphics.hpp"
+#include "spinlock.hpp"
 
 class Console {
 public:
@@ -12,12 +13,14 @@ public:
   void Clear();
 
 private:
+  void Put(char c);
   void NewLine();
 
   PixelWriter &writer_;
   const PixelColor fg_color_, bg_color_;
   char buffer_[kRows][kColumns + 1];
   int cursor_row_, cursor_column_;
+  SpinLock lock_;
 };
 
 extern Console *console;
@@ -12,6 +12,7 @@ public:
     kFull,
     kIsDirectory,
     kNoSuchDirectory,
+    kBadAddress,
     kLastOfCode,
   };
 
@@ -24,6 +25,7 @@ private:
       "kIsDirectory",
       "kNoSuchDirectory",
       "kFull",
+      "kBadAddress",
   };
   static_assert(Error::Code::kLastOfCode == code_names_.size());
 
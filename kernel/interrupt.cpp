@@ -1,9 +1,11 @@
 #include "interrupt.hpp"
 #include "asmfunc.hpp"
 #include "keyboard.hpp"
+#include "paging.hpp"
 #include "pic.hpp"
 #include "printk.hpp"
 #include "segment.hpp"
+#include "task.hpp"
 #include "timer.hpp"
 #include <array>
 #include <csignal>
@@ -59,13 +61,33 @@ FaultHandlerWithError(TS);
 FaultHandlerWithError(NP);
 FaultHandlerWithError(SS);
 FaultHandlerWithError(GP);
-FaultHandlerWithError(PF);
 FaultHandlerWithNoError(MF);
 FaultHandlerWithError(AC);
 FaultHandlerWithNoError(MC);
 FaultHandlerWithNoError(XM);
 FaultHandlerWithNoError(VE);
 
+// HandlePageFault is built with SSE enabled, so the faulting context's FPU state is saved around it
+__attribute__((interrupt)) void IntHandlerPF(InterruptFrame *frame, uint64_t error_code) {
+  alignas(16) uint8_t fxsave_area[512];
+  __asm__ volatile("fxsave %0"
+                   : "=m"(fxsave_area));
+  const auto err = HandlePageFault(error_code, GetCR2());
+  __asm__ volatile("fxrstor %0"
+                   :
+                   : "m"(fxsave_area));
+  if (!err) {
+    return;
+  }
+
+  KillApp(frame);
+  PrintFrame(frame, "#PF");
+  printk("[ERR] %x\n", error_code);
+  printk("CR2: %lx\n", GetCR2());
+  while (true)
+    __asm__("hlt");
+}
+
 __attribute__((interrupt)) void
 IntHandlerKeyboard(InterruptFrame *frame) {
   KeyboardOnInterrupt();
@@ -104,6 +126,7 @@ void InitializeInterrupt() {
 
   set_idt_entry(InterruptVector::kKeyboard, IntHandlerKeyboard);
   set_idt_entry(InterruptVector::kLAPICTimer, IntHandlerLAPICTimer);
+  set_idt_entry(InterruptVector::kWakeup, IntHandlerWakeup);
 
   set_idt_entry(0, IntHandlerDE);
   set_idt_entry(1, IntHandlerDB);
@@ -115,9 +138,9 @@ void InitializeInterrupt() {
   set_idt_entry(8, IntHandlerDF);
   set_idt_entry(10, IntHandlerTS);
   set_idt_entry(11, IntHandlerNP);
-  set_idt_entry(13, IntHandlerSS);
-  set_idt_entry(14, IntHandlerGP);
-  set_idt_entry(15, IntHandlerPF);
+  set_idt_entry(12, IntHandlerSS);
+  set_idt_entry(13, IntHandlerGP);
+  set_idt_entry(14, IntHandlerPF);
   set_idt_entry(16, IntHandlerMF);
   set_idt_entry(17, IntHandlerAC);
   set_idt_entry(18, IntHandlerMC);
@@ -126,3 +149,10 @@ void InitializeInterrupt() {
 
   LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
+
+// an AP's local APIC comes out of INIT software-disabled
+void InitializeInterruptForAP() {
+  volatile auto spurious_interrupt_vector = reinterpret_cast<uint32_t *>(0xfee000f0);
+  *spurious_interrupt_vector = *spurious_interrupt_vector | 0x100;
+  LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+}
@@ -32,6 +32,7 @@ public:
   enum Number {
     kKeyboard = 0x21,
     kLAPICTimer = 0x41,
+    kWakeup = 0x42,
   };
 };
 
@@ -46,3 +47,21 @@ struct InterruptFrame {
 void NotifyEndOfInterrupt();
 
 void InitializeInterrupt();
+// Loads the IDT built by InitializeInterrupt on an AP.
+void InitializeInterruptForAP();
+
+// Masks interrupts and returns the previous RFLAGS to hand to RestoreInterrupts.
+inline uint64_t DisableInterrupts() {
+  uint64_t rflags;
+  __asm__ volatile("pushfq\n\tpopq %0\n\tcli"
+                   : "=r"(rflags)
+                   :
+                   : "memory");
+  return rflags;
+}
+
+inline void RestoreInterrupts(uint64_t rflags) {
+  if (rflags & 0x200) {
+    __asm__ volatile("sti" ::: "memory");
+  }
+}
@@ -1,110 +1,641 @@
 #include "memory_manager.hpp"
+#include "interrupt.hpp"
+#include "paging.hpp"
 #include "printk.hpp"
+#include "smp.hpp"
+#include <algorithm>
+#include <string.h>
 #include <sys/types.h>
 
-BitmapMemoryManager::BitmapMemoryManager() : alloc_map_{}, range_begin_{FrameID(0)}, range_end_{FrameID(kFrameCount)} {
+namespace {
+using MapLineType = BitmapMemoryManager::MapLineType;
+const MapLineType kFullLine = ~static_cast<MapLineType>(0);
+const size_t kBitsPerMapLine = BitmapMemoryManager::kBitsPerMapLine;
+
+size_t RoundUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// length of the longest run of set bits in bits
+int LongestRun(MapLineType bits) {
+  int longest = 0;
+  while (bits != 0) {
+    bits >>= __builtin_ctzl(bits);
+    const int len = ~bits == 0 ? 64 : __builtin_ctzl(~bits);
+    longest = std::max(longest, len);
+    if (len == 64) {
+      break;
+    }
+    bits >>= len;
+  }
+  return longest;
+}
+
+// returns the first frame in [frame, end) whose bit in map equals value, or end
+size_t FindBit(const MapLineType *map, size_t frame, size_t end, bool value) {
+  while (frame < end) {
+    const size_t line_index = frame / kBitsPerMapLine;
+    MapLineType bits = value ? map[line_index] : ~map[line_index];
+    bits &= kFullLine << (frame % kBitsPerMapLine);
+    if (bits != 0) {
+      return std::min(line_index * kBitsPerMapLine + __builtin_ctzl(bits), end);
+    }
+    frame = (line_index + 1) * kBitsPerMapLine;
+  }
+  return end;
+}
+
+// sets or clears the bits [begin, end): masks the first and last lines and memsets the lines between
+void FillBits(MapLineType *map, size_t begin, size_t end, bool value) {
+  if (begin >= end) {
+    return;
+  }
+
+  const size_t first_line = begin / kBitsPerMapLine;
+  const size_t last_line = (end - 1) / kBitsPerMapLine;
+  const MapLineType head_mask = kFullLine << (begin % kBitsPerMapLine);
+  const MapLineType tail_mask = kFullLine >> (kBitsPerMapLine - 1 - (end - 1) % kBitsPerMapLine);
+  auto fill = [map, value](size_t line_index, MapLineType mask) {
+    map[line_index] = value ? map[line_index] | mask : map[line_index] & ~mask;
+  };
+
+  if (first_line == last_line) {
+    fill(first_line, head_mask & tail_mask);
+    return;
+  }
+  fill(first_line, head_mask);
+  memset(&map[first_line + 1], value ? 0xff : 0, (last_line - first_line - 1) * sizeof(MapLineType));
+  fill(last_line, tail_mask);
+}
+
+// index of the lowest bit starting a run of num_bits set bits, or -1
+int FindRun(MapLineType bits, size_t num_bits) {
+  size_t run = 1;
+  while (run < num_bits && bits != 0) {
+    const size_t shift = std::min(run, num_bits - run);
+    bits &= bits >> shift;
+    run += shift;
+  }
+  return bits == 0 ? -1 : __builtin_ctzl(bits);
+}
+} // namespace
+
+size_t BitmapMemoryManager::MetadataBytes(size_t frame_count) {
+  const size_t line_count = RoundUp(frame_count, kBitsPerMapLine * kBitsPerMapLine) / kBitsPerMapLine;
+  return line_count * sizeof(MapLineType) + 2 * line_count / 8 + line_count;
 }
 
-WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-  size_t start_frame_id = range_begin_.ID();
-  while (true) {
-    size_t i = 0;
-    for (; i < num_frames; ++i) {
-      if (start_frame_id + i >= range_end_.ID()) {
-        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+BitmapMemoryManager::BitmapMemoryManager(void *metadata, size_t frame_count)
+    : frame_count_{RoundUp(frame_count, kBitsPerMapLine * kBitsPerMapLine)},
+      range_begin_{FrameID(0)}, range_end_{FrameID(frame_count_)}, next_frame_{FrameID(0)} {
+  const size_t line_count = frame_count_ / kBitsPerMapLine;
+  alloc_map_ = reinterpret_cast<MapLineType *>(metadata);
+  full_lines_ = alloc_map_ + line_count;
+  free_lines_ = full_lines_ + line_count / kBitsPerMapLine;
+  longest_free_run_ = reinterpret_cast<uint8_t *>(free_lines_ + line_count / kBitsPerMapLine);
+
+  memset(alloc_map_, 0, line_count * sizeof(MapLineType));
+  memset(full_lines_, 0, line_count / 8);
+  memset(free_lines_, 0xff, line_count / 8);
+  memset(longest_free_run_, kBitsPerMapLine, line_count);
+}
+
+WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames, size_t align_frames) {
+  SpinLockGuard guard{lock_};
+  const size_t hint = std::max(next_frame_.ID(), range_begin_.ID());
+  auto start_frame = FindAlignedRun(hint, range_end_.ID(), num_frames, align_frames);
+  if (start_frame.ID() == kNullFrame.ID()) {
+    // wrap around: a run found here may extend up to num_frames - 1 frames past the hint
+    const size_t end = std::min(hint + num_frames - 1, range_end_.ID());
+    start_frame = FindAlignedRun(range_begin_.ID(), end, num_frames, align_frames);
+  }
+  if (start_frame.ID() == kNullFrame.ID()) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  SetBits(start_frame.ID(), start_frame.ID() + num_frames, true);
+  next_frame_ = FrameID{start_frame.ID() + num_frames};
+  return {
+      start_frame,
+      MAKE_ERROR(Error::kSuccess),
+  };
+}
+
+Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
+  SpinLockGuard guard{lock_};
+  SetBits(start_frame.ID(), start_frame.ID() + num_frames, false);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
+  SpinLockGuard guard{lock_};
+  SetBits(start_frame.ID(), start_frame.ID() + num_frames, true);
+}
+
+void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
+  range_begin_ = range_begin;
+  range_end_ = FrameID{std::min(range_end.ID(), frame_count_)};
+  next_frame_ = range_begin_;
+}
+
+FrameID BitmapMemoryManager::FindFreeRun(size_t begin, size_t end, size_t num_frames) const {
+  if (begin + num_frames > end) {
+    return kNullFrame;
+  }
+  if (num_frames == 0) {
+    return FrameID{begin};
+  }
+
+  // run: number of free frames contiguous up to the start of the current line
+  size_t run_start = begin, run = 0;
+  size_t line_index = begin / kBitsPerMapLine;
+  const size_t whole_lines_end = end / kBitsPerMapLine;
+  while (line_index * kBitsPerMapLine < end) {
+    const size_t line_begin = line_index * kBitsPerMapLine;
+    MapLineType free_bits = ~alloc_map_[line_index];
+    if (line_begin < begin) {
+      free_bits &= kFullLine << (begin - line_begin);
+    }
+    if (end - line_begin < kBitsPerMapLine) {
+      free_bits &= (static_cast<MapLineType>(1) << (end - line_begin)) - 1;
+    }
+
+    if (free_bits == 0) {
+      run = 0;
+      line_index = std::max(FindBit(full_lines_, line_index + 1, whole_lines_end, false), line_index + 1);
+      continue;
+    }
+
+    if (free_bits == kFullLine) {
+      if (run == 0) {
+        run_start = line_begin;
       }
-      if (GetBit(FrameID{start_frame_id + i})) {
-        break;
+      const size_t next_line = std::max(FindBit(free_lines_, line_index, whole_lines_end, false), line_index + 1);
+      run += (next_line - line_index) * kBitsPerMapLine;
+      if (run >= num_frames) {
+        return FrameID{run_start};
+      }
+      line_index = next_line;
+      continue;
+    }
+
+    const size_t leading = __builtin_ctzl(~free_bits);
+    if (run > 0 && run + leading >= num_frames) {
+      return FrameID{run_start};
+    }
+
+    const bool masked = line_begin < begin || end - line_begin < kBitsPerMapLine;
+    if (num_frames <= kBitsPerMapLine && (masked || longest_free_run_[line_index] >= num_frames)) {
+      if (const int bit = FindRun(free_bits, num_frames); bit >= 0) {
+        return FrameID{line_begin + bit};
       }
     }
-    if (i == num_frames) {
-      MarkAllocated(FrameID{start_frame_id}, num_frames);
-      return {
-          FrameID{start_frame_id},
-          MAKE_ERROR(Error::kSuccess),
-      };
+
+    run = __builtin_clzl(~free_bits);
+    run_start = line_begin + kBitsPerMapLine - run;
+    ++line_index;
+  }
+  return kNullFrame;
+}
+
+FrameID BitmapMemoryManager::FindAlignedRun(size_t begin, size_t end, size_t num_frames, size_t align_frames) const {
+  if (align_frames <= 1) {
+    return FindFreeRun(begin, end, num_frames);
+  }
+
+  // take the first free run and check whether it stretches to the next aligned frame;
+  // if not, some frame in between is allocated and the search resumes past it
+  size_t start = RoundUp(begin, align_frames);
+  while (start + num_frames <= end) {
+    const auto run = FindFreeRun(start, end, num_frames);
+    if (run.ID() == kNullFrame.ID()) {
+      break;
     }
-    start_frame_id += i + 1;
+
+    const size_t aligned = RoundUp(run.ID(), align_frames);
+    if (aligned == run.ID() || FindFreeRun(aligned, std::min(aligned + num_frames, end), num_frames).ID() == aligned) {
+      return FrameID{aligned};
+    }
+    start = aligned;
   }
+  return kNullFrame;
 }
 
-Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
-  for (size_t i = 0; i < num_frames; ++i) {
-    SetBit(FrameID{start_frame.ID() + i}, false);
+void BitmapMemoryManager::SetBits(size_t begin, size_t end, bool allocated) {
+  end = std::min(end, frame_count_);
+  if (begin >= end) {
+    return;
+  }
+  FillBits(alloc_map_, begin, end, allocated);
+
+  // lines completely inside [begin, end) have a known summary; only the partial lines at the edges are rescanned
+  const size_t whole_begin = (begin + kBitsPerMapLine - 1) / kBitsPerMapLine;
+  const size_t whole_end = end / kBitsPerMapLine;
+  if (whole_begin >= whole_end) {
+    UpdateSummary(begin, end);
+    return;
+  }
+
+  FillBits(full_lines_, whole_begin, whole_end, allocated);
+  FillBits(free_lines_, whole_begin, whole_end, !allocated);
+  memset(&longest_free_run_[whole_begin], allocated ? 0 : kBitsPerMapLine, whole_end - whole_begin);
+  UpdateSummary(begin, whole_begin * kBitsPerMapLine);
+  UpdateSummary(whole_end * kBitsPerMapLine, end);
+}
+
+void BitmapMemoryManager::UpdateSummary(size_t begin, size_t end) {
+  if (begin >= end) {
+    return;
+  }
+
+  for (size_t line_index = begin / kBitsPerMapLine; line_index <= (end - 1) / kBitsPerMapLine; ++line_index) {
+    const MapLineType line = alloc_map_[line_index];
+    const MapLineType summary_bit = static_cast<MapLineType>(1) << (line_index % kBitsPerMapLine);
+    auto &full = full_lines_[line_index / kBitsPerMapLine];
+    auto &free = free_lines_[line_index / kBitsPerMapLine];
+
+    full = line == kFullLine ? full | summary_bit : full & ~summary_bit;
+    free = line == 0 ? free | summary_bit : free & ~summary_bit;
+    longest_free_run_[line_index] = LongestRun(~line);
+  }
+}
+
+size_t BuddyMemoryManager::MetadataBytes(size_t frame_count) {
+  return RoundUp(frame_count, static_cast<size_t>(1) << kMaxOrder) / 8;
+}
+
+BuddyMemoryManager::BuddyMemoryManager(void *metadata, size_t frame_count)
+    : frame_count_{RoundUp(frame_count, static_cast<size_t>(1) << kMaxOrder)},
+      head_map_{reinterpret_cast<MapLineType *>(metadata)}, free_lists_{},
+      range_begin_{FrameID(0)}, range_end_{FrameID(0)}, ready_{false} {
+  memset(head_map_, 0, frame_count_ / 8);
+}
+
+WithError<FrameID> BuddyMemoryManager::Allocate(size_t num_frames, size_t align_frames) {
+  SpinLockGuard guard{lock_};
+  // blocks are aligned to their size, so a large alignment only needs a large enough block
+  int order = 0;
+  while ((static_cast<size_t>(1) << order) < std::max(num_frames, align_frames)) {
+    ++order;
+  }
+
+  int block_order = order;
+  while (block_order <= kMaxOrder && free_lists_[block_order] == nullptr) {
+    ++block_order;
+  }
+  if (!ready_ || block_order > kMaxOrder) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  const size_t frame = FrameOf(free_lists_[block_order]);
+  RemoveBlock(frame);
+  while (block_order > order) {
+    --block_order;
+    PushBlock(frame + (static_cast<size_t>(1) << block_order), block_order);
+  }
+
+  const size_t block_frames = static_cast<size_t>(1) << order;
+  if (num_frames < block_frames) {
+    FreeBlocks(frame + num_frames, block_frames - num_frames);
   }
+  return {FrameID{frame}, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error BuddyMemoryManager::Free(FrameID start_frame, size_t num_frames) {
+  SpinLockGuard guard{lock_};
+  FreeBlocks(start_frame.ID(), num_frames);
   return MAKE_ERROR(Error::kSuccess);
 }
 
-void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
-  for (size_t i = 0; i < num_frames; ++i) {
-    SetBit(FrameID{start_frame.ID() + i}, true);
+void BuddyMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
+  SpinLockGuard guard{lock_};
+  const size_t end = std::min(start_frame.ID() + num_frames, frame_count_);
+  if (!ready_) {
+    FillBits(head_map_, start_frame.ID(), end, true);
+    return;
+  }
+
+  size_t frame = start_frame.ID();
+  while (frame < end) {
+    auto block = FindBlock(frame);
+    if (block == nullptr) {
+      ++frame;
+      continue;
+    }
+
+    const size_t block_frame = FrameOf(block);
+    const size_t block_end = block_frame + (static_cast<size_t>(1) << block->order);
+    RemoveBlock(block_frame);
+    if (block_frame < frame) {
+      FreeBlocks(block_frame, frame - block_frame);
+    }
+    if (end < block_end) {
+      FreeBlocks(end, block_end - end);
+    }
+    frame = block_end;
   }
 }
 
-void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
+void BuddyMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
   range_begin_ = range_begin;
-  range_end_ = range_end;
+  range_end_ = FrameID{std::min(range_end.ID(), frame_count_)};
+  ready_ = true;
+
+  FillBits(head_map_, 0, range_begin_.ID(), false);
+  FillBits(head_map_, range_end_.ID(), frame_count_, false);
+
+  size_t frame = range_begin_.ID();
+  while (frame < range_end_.ID()) {
+    const size_t free_begin = FindBit(head_map_, frame, range_end_.ID(), false);
+    FillBits(head_map_, frame, free_begin, false);
+    const size_t free_end = FindBit(head_map_, free_begin, range_end_.ID(), true);
+    // frames past free_end may still carry MarkAllocated bits, so do not look for buddies there
+    FreeBlocks(free_begin, free_end - free_begin, false);
+    frame = free_end;
+  }
 }
 
-bool BitmapMemoryManager::GetBit(FrameID frame) const {
-  auto line_index = frame.ID() / kBitsPerMapLine;
-  auto bit_index = frame.ID() % kBitsPerMapLine;
+void BuddyMemoryManager::PushBlock(size_t frame, int order) {
+  auto block = Block(frame);
+  block->prev = nullptr;
+  block->next = free_lists_[order];
+  block->order = order;
+  if (block->next) {
+    block->next->prev = block;
+  }
+  free_lists_[order] = block;
+  SetBit(frame, true);
+}
 
-  return (alloc_map_[line_index] & (static_cast<MapLineType>(1) << bit_index)) != 0;
+void BuddyMemoryManager::RemoveBlock(size_t frame) {
+  auto block = Block(frame);
+  if (block->prev) {
+    block->prev->next = block->next;
+  } else {
+    free_lists_[block->order] = block->next;
+  }
+  if (block->next) {
+    block->next->prev = block->prev;
+  }
+  SetBit(frame, false);
 }
 
-void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
-  auto line_index = frame.ID() / kBitsPerMapLine;
-  auto bit_index = frame.ID() % kBitsPerMapLine;
+// splits [frame, frame + num_frames) into aligned blocks and, if merge is set, merges each with its free buddies
+void BuddyMemoryManager::FreeBlocks(size_t frame, size_t num_frames, bool merge) {
+  while (num_frames > 0) {
+    int order = std::min(kMaxOrder, 63 - __builtin_clzl(num_frames));
+    if (frame != 0) {
+      order = std::min(order, __builtin_ctzl(frame));
+    }
+    const size_t block_frames = static_cast<size_t>(1) << order;
 
-  if (allocated) {
-    alloc_map_[line_index] |= (static_cast<MapLineType>(1) << bit_index);
+    size_t block_frame = frame;
+    int block_order = order;
+    while (merge && block_order < kMaxOrder) {
+      const size_t buddy = block_frame ^ (static_cast<size_t>(1) << block_order);
+      if (!GetBit(buddy) || Block(buddy)->order != block_order) {
+        break;
+      }
+      RemoveBlock(buddy);
+      block_frame = std::min(block_frame, buddy);
+      ++block_order;
+    }
+    PushBlock(block_frame, block_order);
+
+    frame += block_frames;
+    num_frames -= block_frames;
+  }
+}
+
+// returns the free block containing frame, or nullptr if frame is allocated
+BuddyMemoryManager::FreeBlock *BuddyMemoryManager::FindBlock(size_t frame) const {
+  for (int order = 0; order <= kMaxOrder; ++order) {
+    const size_t block_frame = frame & ~((static_cast<size_t>(1) << order) - 1);
+    if (GetBit(block_frame) && Block(block_frame)->order >= order) {
+      return Block(block_frame);
+    }
+  }
+  return nullptr;
+}
+
+bool BuddyMemoryManager::GetBit(size_t frame) const {
+  return (head_map_[frame / kBitsPerMapLine] & (static_cast<MapLineType>(1) << (frame % kBitsPerMapLine))) != 0;
+}
+
+void BuddyMemoryManager::SetBit(size_t frame, bool value) {
+  const auto bit = static_cast<MapLineType>(1) << (frame % kBitsPerMapLine);
+  if (value) {
+    head_map_[frame / kBitsPerMapLine] |= bit;
   } else {
-    alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
+    head_map_[frame / kBitsPerMapLine] &= ~bit;
   }
 }
 
 extern "C" caddr_t program_break, program_break_end;
-BitmapMemoryManager *memory_manager;
+MemoryManager *memory_manager;
 
 namespace {
-char memory_manager_buf[sizeof(BitmapMemoryManager)];
+char memory_manager_buf[sizeof(MemoryManager)];
+FrameID low_memory_frame{kNullFrame};
 
-Error InitializeHeap(BitmapMemoryManager &memory_manager) {
-  const int kHeapFrames = 64 * 512;
-  const auto heap_start = memory_manager.Allocate(kHeapFrames);
-  if (heap_start.error) {
-    return heap_start.error;
-  }
+// the heap lives in its own PML4 slot right above the identity map, so every
+// page map copied from the kernel's sees it grow
+const uintptr_t kHeapBase = 0x0000'0080'0000'0000;
+const uintptr_t kHeapLimit = 0x0000'0100'0000'0000;
+const size_t kHeapChunkBytes = 1_MiB;
 
-  program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-  program_break_end = program_break + kHeapFrames * kBytesPerFrame;
+Error InitializeHeap() {
+  program_break = program_break_end = reinterpret_cast<caddr_t>(kHeapBase);
+  if (GrowKernelHeap(program_break + kHeapChunkBytes) != 0) {
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+  }
   return MAKE_ERROR(Error::kSuccess);
 }
 } // namespace
 
-void InitializeMemoryManager(const MemoryMap &memory_map) {
-  ::memory_manager = new (memory_manager_buf) BitmapMemoryManager();
+extern "C" int GrowKernelHeap(caddr_t new_break) {
+  const auto end = reinterpret_cast<uintptr_t>(program_break_end);
+  const auto new_end = RoundUp(reinterpret_cast<uintptr_t>(new_break), kHeapChunkBytes);
+  if (new_end > kHeapLimit) {
+    return -1;
+  }
+
+  const auto num_4kpages = (new_end - end) / kBytesPerFrame;
+  if (auto err = SetupPageMaps(LinearAddress4Level{end}, num_4kpages, false)) {
+    UnmapPages(LinearAddress4Level{end}, num_4kpages);
+    return -1;
+  }
+  program_break_end = reinterpret_cast<caddr_t>(new_end);
+  return 0;
+}
+
+// The heap's global PTEs stay in every CPU's TLB, and invlpg reaches only this one. A shootdown
+// IPI cannot be waited for here either: free() holds the malloc lock with interrupts masked, and
+// another CPU spinning on it would never take the IPI. So the heap stops shrinking once the APs run.
+extern "C" void ShrinkKernelHeap(caddr_t new_break) {
+  if (NumCPUs() > 1) {
+    return;
+  }
+
+  // one spare chunk stays mapped so malloc/free at the boundary does not remap every time
+  const auto end = reinterpret_cast<uintptr_t>(program_break_end);
+  const auto keep_end = RoundUp(reinterpret_cast<uintptr_t>(new_break), kHeapChunkBytes) + kHeapChunkBytes;
+  if (keep_end >= end) {
+    return;
+  }
 
+  UnmapPages(LinearAddress4Level{keep_end}, (end - keep_end) / kBytesPerFrame);
+  program_break_end = reinterpret_cast<caddr_t>(keep_end);
+}
+
+size_t KernelHeapMappedBytes() {
+  return program_break_end - reinterpret_cast<caddr_t>(kHeapBase);
+}
+
+size_t KernelHeapUsedBytes() {
+  return program_break - reinterpret_cast<caddr_t>(kHeapBase);
+}
+
+namespace {
+const size_t kZeroedPoolFrames = 512;
+std::array<size_t, kZeroedPoolFrames> zeroed_pool;
+size_t zeroed_pool_size, zeroed_pool_hits, zeroed_pool_misses;
+SpinLock zeroed_pool_lock;
+} // namespace
+
+WithError<FrameID> AllocateZeroedFrame() {
+  zeroed_pool_lock.Lock();
+  if (zeroed_pool_size > 0) {
+    const FrameID frame{zeroed_pool[--zeroed_pool_size]};
+    ++zeroed_pool_hits;
+    zeroed_pool_lock.Unlock();
+    return {frame, MAKE_ERROR(Error::kSuccess)};
+  }
+  ++zeroed_pool_misses;
+  zeroed_pool_lock.Unlock();
+
+  auto frame = memory_manager->Allocate(1);
+  if (!frame.error) {
+    memset(frame.value.Frame(), 0, kBytesPerFrame);
+  }
+  return frame;
+}
+
+bool RefillZeroedPool() {
+  if (zeroed_pool_size == kZeroedPoolFrames) {
+    return false;
+  }
+
+  auto frame = memory_manager->Allocate(1);
+  if (frame.error) {
+    return false;
+  }
+  memset(frame.value.Frame(), 0, kBytesPerFrame);
+
+  zeroed_pool_lock.Lock();
+  const bool full = zeroed_pool_size == kZeroedPoolFrames;
+  if (!full) {
+    zeroed_pool[zeroed_pool_size++] = frame.value.ID();
+  }
+  zeroed_pool_lock.Unlock();
+  if (full) {
+    memory_manager->Free(frame.value, 1);
+  }
+  return !full;
+}
+
+FrameID LowMemoryFrame() {
+  return low_memory_frame;
+}
+
+ZeroedPoolStats GetZeroedPoolStats() {
+  return {zeroed_pool_size, zeroed_pool_hits, zeroed_pool_misses};
+}
+
+void InitializeMemoryManager(const MemoryMap &memory_map) {
   const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+  const auto memory_map_end = memory_map_base + memory_map.map_size;
+  auto for_each_descriptor = [&](auto f) {
+    for (uintptr_t iter = memory_map_base; iter < memory_map_end; iter += memory_map.descriptor_size) {
+      f(*reinterpret_cast<const MemoryDescriptor *>(iter));
+    }
+  };
+
+  // frames beyond the identity map would have no address the kernel can touch them through
+  const uintptr_t identity_map_end = kPageDirectoryCount * 1_GiB;
   uintptr_t available_end = 0;
-  for (uintptr_t iter = memory_map_base; iter < memory_map_base + memory_map.map_size; iter += memory_map.descriptor_size) {
-    auto desc = reinterpret_cast<const MemoryDescriptor *>(iter);
-    if (available_end < desc->physical_start) {
-      memory_manager->MarkAllocated(FrameID{available_end / kBytesPerFrame}, (desc->physical_start - available_end) / kBytesPerFrame);
+  for_each_descriptor([&](const MemoryDescriptor &desc) {
+    if (IsAvailable(static_cast<MemoryType>(desc.type))) {
+      available_end = std::max(available_end, desc.physical_start + desc.number_of_pages * kUEFIPageSize);
     }
+  });
+  if (available_end > identity_map_end) {
+    printk("ignoring %lu MiB of memory above the %lu GiB identity map\n",
+           (available_end - identity_map_end) / 1_MiB, kPageDirectoryCount);
+    available_end = identity_map_end;
+  }
+  const size_t frame_count = available_end / kBytesPerFrame;
 
-    const auto physical_end = desc->physical_start + desc->number_of_pages * kUEFIPageSize;
-    if (IsAvailable(static_cast<MemoryType>(desc->type))) {
+  // the APs' boot code is picked first, so that the metadata cannot end up on top of it
+  for_each_descriptor([&](const MemoryDescriptor &desc) {
+    const auto begin = std::max<uintptr_t>(desc.physical_start, kBytesPerFrame);
+    const auto end = std::min<uintptr_t>(desc.physical_start + desc.number_of_pages * kUEFIPageSize, 1_MiB);
+    if (low_memory_frame.ID() == kNullFrame.ID() && IsAvailable(static_cast<MemoryType>(desc.type)) && begin < end) {
+      low_memory_frame = FrameID{begin / kBytesPerFrame};
+    }
+  });
+  const auto low_memory_addr = low_memory_frame.ID() == kNullFrame.ID() ? 0 : low_memory_frame.ID() * kBytesPerFrame;
+
+  // the manager's metadata goes to the first available region large enough to hold it,
+  // except the one holding the memory map we are still reading
+  const size_t metadata_frames = (MemoryManager::MetadataBytes(frame_count) + kBytesPerFrame - 1) / kBytesPerFrame;
+  uintptr_t metadata_addr = 0;
+  for_each_descriptor([&](const MemoryDescriptor &desc) {
+    const auto physical_end = std::min(desc.physical_start + desc.number_of_pages * kUEFIPageSize, identity_map_end);
+    const bool holds_memory_map = desc.physical_start < memory_map_end && memory_map_base < physical_end;
+    // the low frame is the first one of its region, so the metadata can start right after it
+    auto begin = desc.physical_start;
+    if (low_memory_addr != 0 && begin <= low_memory_addr && low_memory_addr < physical_end) {
+      begin = low_memory_addr + kBytesPerFrame;
+    }
+    if (metadata_addr == 0 && begin > 0 && !holds_memory_map &&
+        IsAvailable(static_cast<MemoryType>(desc.type)) && begin < physical_end &&
+        physical_end - begin >= metadata_frames * kBytesPerFrame) {
+      metadata_addr = begin;
+    }
+  });
+  if (metadata_addr == 0) {
+    printk("no room for the memory manager: %lu frames\n", metadata_frames);
+    exit(1);
+  }
+
+  ::memory_manager = new (memory_manager_buf) MemoryManager(reinterpret_cast<void *>(metadata_addr), frame_count);
+  memory_manager->MarkAllocated(FrameID{metadata_addr / kBytesPerFrame}, metadata_frames);
+
+  available_end = 0;
+  for_each_descriptor([&](const MemoryDescriptor &desc) {
+    if (desc.physical_start >= identity_map_end) {
+      return;
+    }
+    if (available_end < desc.physical_start) {
+      memory_manager->MarkAllocated(FrameID{available_end / kBytesPerFrame}, (desc.physical_start - available_end) / kBytesPerFrame);
+    }
+
+    const auto physical_end = std::min(desc.physical_start + desc.number_of_pages * kUEFIPageSize, identity_map_end);
+    if (IsAvailable(static_cast<MemoryType>(desc.type))) {
       available_end = physical_end;
     } else {
-      memory_manager->MarkAllocated(FrameID{desc->physical_start / kBytesPerFrame}, desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
+      memory_manager->MarkAllocated(FrameID{desc.physical_start / kBytesPerFrame}, (physical_end - desc.physical_start) / kBytesPerFrame);
     }
+  });
+  memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
+
+  if (low_memory_frame.ID() != kNullFrame.ID()) {
+    memory_manager->MarkAllocated(low_memory_frame, 1);
   }
-  memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end});
 
-  if (auto err = InitializeHeap(*memory_manager)) {
+  if (auto err = InitializeHeap()) {
     printk("failed to allocate pages: %s\n", err.Name());
     exit(1);
   }
-}
\ No newline at end of file
+}
@@ -2,6 +2,7 @@
 
 #include "error.hpp"
 #include "memory_map.hpp"
+#include "spinlock.hpp"
 #include <array>
 #include <limits>
 #include <stddef.h>
@@ -34,31 +35,120 @@ private:
 
 static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
 
+// The bitmap and its summary live in a caller-provided buffer of MetadataBytes(frame_count) bytes,
+// so that it can be sized from the memory map and placed before the heap exists.
 class BitmapMemoryManager {
 public:
-  static const auto kMaxPhysicalMemoryBytes{128_GiB};
-  static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
-
   using MapLineType = unsigned long;
   static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
 
-  BitmapMemoryManager();
+  static size_t MetadataBytes(size_t frame_count);
+
+  BitmapMemoryManager(void *metadata, size_t frame_count);
 
-  WithError<FrameID> Allocate(size_t num_frames);
+  // align_frames must be a power of two; the first frame's ID is a multiple of it
+  WithError<FrameID> Allocate(size_t num_frames, size_t align_frames = 1);
   Error Free(FrameID start_frame, size_t num_frames);
   void MarkAllocated(FrameID start_frame, size_t num_frames);
 
   void SetMemoryRange(FrameID range_begin, FrameID range_end);
 
 private:
-  std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+  size_t frame_count_;
+  MapLineType *alloc_map_;
+  // one bit per line of alloc_map_, set when all 64 frames of the line are allocated / free
+  MapLineType *full_lines_;
+  MapLineType *free_lines_;
+  uint8_t *longest_free_run_;
   FrameID range_begin_;
   FrameID range_end_;
+  // next-fit hint: the search starts here and wraps around to range_begin_
+  FrameID next_frame_;
+  SpinLock lock_;
+
+  FrameID FindFreeRun(size_t begin, size_t end, size_t num_frames) const;
+  FrameID FindAlignedRun(size_t begin, size_t end, size_t num_frames, size_t align_frames) const;
+  void SetBits(size_t begin, size_t end, bool allocated);
+  void UpdateSummary(size_t begin, size_t end);
+};
+
+// Power-of-two buddy allocator with the same interface as BitmapMemoryManager.
+// Free blocks are linked through their first frame; head_map_ marks the first frame of every free block.
+// Until SetMemoryRange is called, head_map_ records the frames passed to MarkAllocated instead, and
+// SetMemoryRange turns the remaining frames into free blocks.
+class BuddyMemoryManager {
+public:
+  static constexpr int kMaxOrder{18};
+
+  using MapLineType = BitmapMemoryManager::MapLineType;
+  static const size_t kBitsPerMapLine{BitmapMemoryManager::kBitsPerMapLine};
+
+  static size_t MetadataBytes(size_t frame_count);
+
+  BuddyMemoryManager(void *metadata, size_t frame_count);
+
+  // align_frames must be a power of two; the first frame's ID is a multiple of it
+  WithError<FrameID> Allocate(size_t num_frames, size_t align_frames = 1);
+  Error Free(FrameID start_frame, size_t num_frames);
+  void MarkAllocated(FrameID start_frame, size_t num_frames);
 
-  bool GetBit(FrameID frame) const;
-  void SetBit(FrameID frame, bool allocated);
+  void SetMemoryRange(FrameID range_begin, FrameID range_end);
+
+private:
+  struct FreeBlock {
+    FreeBlock *prev, *next;
+    int order;
+  };
+
+  size_t frame_count_;
+  MapLineType *head_map_;
+  std::array<FreeBlock *, kMaxOrder + 1> free_lists_;
+  FrameID range_begin_;
+  FrameID range_end_;
+  bool ready_;
+  SpinLock lock_;
+
+  static FreeBlock *Block(size_t frame) {
+    return reinterpret_cast<FreeBlock *>(frame * kBytesPerFrame);
+  }
+  static size_t FrameOf(const FreeBlock *block) {
+    return reinterpret_cast<uintptr_t>(block) / kBytesPerFrame;
+  }
+
+  void PushBlock(size_t frame, int order);
+  void RemoveBlock(size_t frame);
+  void FreeBlocks(size_t frame, size_t num_frames, bool merge = true);
+  FreeBlock *FindBlock(size_t frame) const;
+
+  bool GetBit(size_t frame) const;
+  void SetBit(size_t frame, bool value);
 };
 
-extern BitmapMemoryManager *memory_manager;
+#ifdef MEMORY_MANAGER_BUDDY
+using MemoryManager = BuddyMemoryManager;
+#else
+using MemoryManager = BitmapMemoryManager;
+#endif
+
+extern MemoryManager *memory_manager;
 
 void InitializeMemoryManager(const MemoryMap &memory_map);
+
+// The kernel heap starts at one chunk and sbrk maps or unmaps frames as the break moves.
+extern "C" int GrowKernelHeap(char *new_break);
+extern "C" void ShrinkKernelHeap(char *new_break);
+size_t KernelHeapMappedBytes();
+size_t KernelHeapUsedBytes();
+
+// A frame below 1 MiB reserved at startup for the APs' real-mode boot code, or kNullFrame.
+FrameID LowMemoryFrame();
+
+// Single frames zeroed ahead of time by the idle task, so page table setup can skip the memset.
+WithError<FrameID> AllocateZeroedFrame();
+// Zeroes one more frame into the pool. Returns false once the pool is full or memory runs out.
+bool RefillZeroedPool();
+
+struct ZeroedPoolStats {
+  size_t frames, hits, misses;
+};
+ZeroedPoolStats GetZeroedPoolStats();
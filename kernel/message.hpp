@@ -1,4 +1,7 @@
 #pragma once
+#include <array>
+#include <atomic>
+#include <stddef.h>
 #include <stdint.h>
 
 struct Message {
@@ -22,3 +25,66 @@ struct Message {
     } pipe;
   } arg;
 };
+
+// Fixed-size mailbox that any number of senders, interrupt handlers included, push to without locks
+// or allocation, and that its owning task alone pops from. A message sent to a full ring is dropped.
+class MessageRing {
+public:
+  static const size_t kCapacity = 64;
+
+  MessageRing() {
+    for (size_t i = 0; i < kCapacity; ++i) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns false and counts the message as dropped if the ring is full.
+  bool Push(const Message &msg) {
+    auto pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      auto &slot = slots_[pos % kCapacity];
+      const auto diff = static_cast<int64_t>(slot.seq.load(std::memory_order_acquire) - pos);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          slot.msg = msg;
+          slot.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Pops up to max_msgs messages in the order they were pushed and returns how many it popped.
+  size_t Pop(Message *msgs, size_t max_msgs) {
+    size_t n = 0;
+    for (; n < max_msgs; ++n) {
+      auto &slot = slots_[tail_ % kCapacity];
+      if (slot.seq.load(std::memory_order_acquire) != tail_ + 1) {
+        break;
+      }
+      msgs[n] = slot.msg;
+      slot.seq.store(tail_ + kCapacity, std::memory_order_release);
+      ++tail_;
+    }
+    return n;
+  }
+
+  size_t Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  // a slot is free for the push at position seq, and holds a message for the pop at position seq - 1
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    Message msg;
+  };
+
+  std::array<Slot, kCapacity> slots_;
+  std::atomic<uint64_t> head_{0};
+  uint64_t tail_{0};
+  std::atomic<size_t> dropped_{0};
+};
@@ -1,34 +1,503 @@
 #include "paging.hpp"
 #include "asmfunc.hpp"
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+#include "printk.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+#include <algorithm>
 #include <array>
+#include <bitset>
+#include <cpuid.h>
 #include <stdint.h>
+#include <string.h>
 
 namespace {
 const uint64_t kPageSize4K = 4096;
 const uint64_t kPageSize2M = 512 * kPageSize4K;
 const uint64_t kPageSize1G = 512 * kPageSize2M;
+const size_t kFramesPer2MPage = kPageSize2M / kBytesPerFrame;
 
 alignas(kPageSize4K) std::array<uint64_t, 512> pml4_table;
 alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
 alignas(kPageSize4K) std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+
+const uint32_t kCPUIDPAT = 1u << 16;
+const uint32_t kCPUIDPCID = 1u << 17;
+const uint32_t kCPUIDPDPE1GB = 1u << 26;
+const uint64_t kCR4PGE = 1u << 7;
+const uint64_t kCR4PCIDE = 1u << 17;
+const uint64_t kCR3PCIDMask = 0xfff;
+const uint64_t kPageWriteThrough = 0x008;
+const uint64_t kPageHuge = 0x080;
+
+// PAT entry 1, which PWT alone selects, holds the framebuffer's memory type; nothing else sets PWT
+const uint32_t kMSRPAT = 0x277;
+const uint64_t kPATEntry1Mask = 0xffull << 8;
+const uint64_t kPATUncacheable = 0x00;
+const uint64_t kPATWriteCombining = 0x01;
+
+std::bitset<4096> pcid_used{1};
+SpinLock pcid_lock;
+bool identity_1g_pages;
+bool frame_buffer_pat;
+// the PAT every CPU loads, with the framebuffer write-combining
+uint64_t pat_value;
+
+bool Supports1GPages() {
+#ifdef DISABLE_1G_PAGES
+  return false;
+#else
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (edx & kCPUIDPDPE1GB);
+#endif
+}
+
+void EnablePCID() {
+#ifndef DISABLE_PCID
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & kCPUIDPCID)) {
+    return;
+  }
+
+  SetCR4(GetCR4() | kCR4PCIDE);
+  cr3_no_flush_mask = 1ull << 63;
+#endif
+}
+
+// drops TLB entries of every PCID, global ones included
+void FlushAllTLB() {
+  const auto cr4 = GetCR4();
+  SetCR4(cr4 ^ kCR4PGE);
+  SetCR4(cr4);
+}
 } // namespace
 
+uint64_t cr3_no_flush_mask;
+
 void ResetCR3() {
-  SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
+  SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]) | cr3_no_flush_mask);
+}
+
+PageMapEntry *CurrentPML4() {
+  return reinterpret_cast<PageMapEntry *>(GetCR3() & ~kCR3PCIDMask);
+}
+
+WithError<uint16_t> AllocatePCID() {
+  if (cr3_no_flush_mask == 0) {
+    return {0, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  SpinLockGuard guard{pcid_lock};
+  for (uint16_t pcid = 1; pcid < pcid_used.size(); ++pcid) {
+    if (!pcid_used[pcid]) {
+      pcid_used[pcid] = true;
+      return {pcid, MAKE_ERROR(Error::kSuccess)};
+    }
+  }
+  return {0, MAKE_ERROR(Error::kFull)};
+}
+
+void FreePCID(uint16_t pcid) {
+  if (pcid != 0) {
+    SpinLockGuard guard{pcid_lock};
+    pcid_used[pcid] = false;
+  }
 }
 
+// the identity map is the same in every page map, so its entries are global and survive CR3 loads
 void SetupIdentityPageTable() {
+  identity_1g_pages = Supports1GPages();
   pml4_table[0] = reinterpret_cast<uint64_t>(&pdp_table[0]) | 0x003;
   for (int i_pdpt = 0; i_pdpt < page_directory.size(); ++i_pdpt) {
+    if (identity_1g_pages) {
+      pdp_table[i_pdpt] = i_pdpt * kPageSize1G | 0x183;
+      continue;
+    }
+
     pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
     for (int i_pd = 0; i_pd < 512; ++i_pd) {
-      page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x083;
+      page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x183;
     }
   }
 
   SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
+  SetCR4(GetCR4() | kCR4PGE);
+}
+
+void FreeUnusedPageDirectories() {
+  if (!identity_1g_pages) {
+    return;
+  }
+  for (int i_pdpt = 0; i_pdpt < page_directory.size(); ++i_pdpt) {
+    if (pdp_table[i_pdpt] & kPageHuge) {
+      memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(&page_directory[i_pdpt]) / kBytesPerFrame}, 1);
+    }
+  }
+}
+
+void MapFrameBufferWriteCombining(const FrameBufferConfig &config) {
+#ifndef DISABLE_WRITE_COMBINING
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & kCPUIDPAT)) {
+    return;
+  }
+
+  // the framebuffer lives in a PCI BAR aligned to its own power-of-two size,
+  // so the 2 MiB pages around it hold no RAM
+  const auto fb_begin = reinterpret_cast<uint64_t>(config.frame_buffer);
+  const auto fb_end = fb_begin + 4ull * config.pixels_per_scan_line * config.vertical_resolution;
+  const auto identity_end = page_directory.size() * kPageSize1G;
+  for (auto page = fb_begin & ~(kPageSize2M - 1); page < fb_end && page < identity_end; page += kPageSize2M) {
+    const auto i_pdpt = page / kPageSize1G;
+    if (pdp_table[i_pdpt] & kPageHuge) {
+      for (int i_pd = 0; i_pd < 512; ++i_pd) {
+        page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x183;
+      }
+      pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
+    }
+    page_directory[i_pdpt][page / kPageSize2M % 512] |= kPageWriteThrough;
+  }
+
+  frame_buffer_pat = true;
+  pat_value = ReadMSR(kMSRPAT) & ~kPATEntry1Mask | kPATWriteCombining << 8;
+  SetFrameBufferWriteCombining(true);
+#endif
+}
+
+bool SetFrameBufferWriteCombining(bool enable) {
+  if (!frame_buffer_pat) {
+    return false;
+  }
+
+  // pat_value stays as it is: the APs started later still load write-combining
+  const auto pat = pat_value & ~kPATEntry1Mask | (enable ? kPATWriteCombining : kPATUncacheable) << 8;
+  __asm__ volatile("wbinvd" ::: "memory");
+  WriteMSR(kMSRPAT, pat);
+  FlushAllTLB();
+  return true;
+}
+
+uint64_t IdentityPageBytes() {
+  return identity_1g_pages ? kPageSize1G : kPageSize2M;
 }
 
 void InitializePaging() {
   SetupIdentityPageTable();
+  EnablePCID();
+}
+
+void InitializePagingForAP() {
+  SetCR4(GetCR4() | kCR4PGE | (cr3_no_flush_mask != 0 ? kCR4PCIDE : 0));
+  if (frame_buffer_pat) {
+    WriteMSR(kMSRPAT, pat_value);
+  }
+  ResetCR3();
+}
+
+namespace {
+// page maps given back by apps, already zero and ready to be handed out again
+const size_t kPageMapCacheFrames = 256;
+std::array<PageMapEntry *, kPageMapCacheFrames> page_map_cache;
+size_t page_map_cache_size, page_map_cache_hits, page_map_cache_misses;
+SpinLock page_map_cache_lock;
+} // namespace
+
+WithError<PageMapEntry *> NewPageMap() {
+  page_map_cache_lock.Lock();
+  if (page_map_cache_size > 0) {
+    const auto page_map = page_map_cache[--page_map_cache_size];
+    ++page_map_cache_hits;
+    page_map_cache_lock.Unlock();
+    return {page_map, MAKE_ERROR(Error::kSuccess)};
+  }
+  ++page_map_cache_misses;
+  page_map_cache_lock.Unlock();
+
+  auto frame = AllocateZeroedFrame();
+  if (frame.error) {
+    return {nullptr, frame.error};
+  }
+
+  return {reinterpret_cast<PageMapEntry *>(frame.value.Frame()), MAKE_ERROR(Error::kSuccess)};
+}
+
+Error FreePageMap(PageMapEntry *page_map) {
+  page_map_cache_lock.Lock();
+  if (page_map_cache_size < kPageMapCacheFrames) {
+    page_map_cache[page_map_cache_size++] = page_map;
+    page_map_cache_lock.Unlock();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  page_map_cache_lock.Unlock();
+
+  const FrameID frame{reinterpret_cast<uintptr_t>(page_map) / kBytesPerFrame};
+  return memory_manager->Free(frame, 1);
+}
+
+PageMapCacheStats GetPageMapCacheStats() {
+  return {page_map_cache_size, page_map_cache_hits, page_map_cache_misses};
+}
+
+namespace {
+WithError<PageMapEntry *> SetNewPageMapIfNotPresent(PageMapEntry &entry) {
+  if (entry.bits.present) {
+    return {entry.Pointer(), MAKE_ERROR(Error::kSuccess)};
+  }
+
+  auto [child_map, err] = NewPageMap();
+  if (err) {
+    return {nullptr, err};
+  }
+
+  entry.SetPointer(child_map);
+  entry.bits.present = 1;
+
+  return {child_map, MAKE_ERROR(Error::kSuccess)};
+}
+
+// maps a 2 MiB app page through a free level 2 entry if 512 aligned frames are available
+bool SetupHugePage(PageMapEntry &entry) {
+#ifdef DISABLE_HUGE_PAGES
+  return false;
+#else
+  if (entry.bits.present) {
+    return false;
+  }
+
+  auto frame = memory_manager->Allocate(kFramesPer2MPage, kFramesPer2MPage);
+  if (frame.error) {
+    return false;
+  }
+  memset(frame.value.Frame(), 0, kPageSize2M);
+
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry *>(frame.value.Frame()));
+  entry.bits.present = 1;
+  entry.bits.writable = 1;
+  entry.bits.user = 1;
+  entry.bits.huge_page = 1;
+  return true;
+#endif
+}
+
+WithError<size_t> SetupPageMap(PageMapEntry *page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kpages, bool user) {
+  while (num_4kpages > 0) {
+    const auto entry_index = addr.Part(page_map_level);
+
+    // the kernel heap stays on 4 KiB pages so that UnmapPages can give them back one by one
+    if (user && page_map_level == 2 && addr.parts.page == 0 && num_4kpages >= kFramesPer2MPage &&
+        SetupHugePage(page_map[entry_index])) {
+      num_4kpages -= kFramesPer2MPage;
+    } else {
+      auto [child_map, err] = SetNewPageMapIfNotPresent(page_map[entry_index]);
+      if (err) {
+        return {num_4kpages, err};
+      }
+      page_map[entry_index].bits.writable = 1;
+      page_map[entry_index].bits.user = user;
+
+      if (page_map_level == 1) {
+        page_map[entry_index].bits.global = !user;
+        --num_4kpages;
+      } else {
+        auto [num_remain_pages, err] = SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages, user);
+        if (err) {
+          return {num_4kpages, err};
+        }
+        num_4kpages = num_remain_pages;
+      }
+    }
+
+    if (entry_index == 511) {
+      break;
+    }
+
+    addr.SetPart(page_map_level, entry_index + 1);
+    for (int level = page_map_level - 1; level >= 1; --level) {
+      addr.SetPart(level, 0);
+    }
+  }
+
+  return {num_4kpages, MAKE_ERROR(Error::kSuccess)};
+}
+
+// the entry for addr at page_map_level, creating the tables above it
+WithError<PageMapEntry *> SetupPageEntry(LinearAddress4Level addr, int page_map_level) {
+  auto page_map = CurrentPML4();
+  for (int level = 4; level > page_map_level; --level) {
+    auto &entry = page_map[addr.Part(level)];
+    auto [child_map, err] = SetNewPageMapIfNotPresent(entry);
+    if (err) {
+      return {nullptr, err};
+    }
+    entry.bits.writable = 1;
+    entry.bits.user = 1;
+    page_map = child_map;
+  }
+  return {&page_map[addr.Part(page_map_level)], MAKE_ERROR(Error::kSuccess)};
+}
+} // namespace
+
+Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool user) {
+  auto pml4_table = CurrentPML4();
+  return SetupPageMap(pml4_table, 4, addr, num_4kpages, user).error;
+}
+
+namespace {
+Error CleanPageMap(PageMapEntry *page_map, int page_map_level) {
+  for (int i = 0; i < 512; ++i) {
+    auto entry = page_map[i];
+    if (!entry.bits.present) {
+      continue;
+    }
+
+    page_map[i].data = 0;
+    if (page_map_level > 1 && !entry.bits.huge_page) {
+      // the cleaned child is all zero, so it can go back to the page map cache as is
+      if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1)) {
+        return err;
+      }
+      if (auto err = FreePageMap(entry.Pointer())) {
+        return err;
+      }
+      continue;
+    } else if (entry.bits.shared) {
+      continue;
+    }
+
+    const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
+    const FrameID map_frame{entry_addr / kBytesPerFrame};
+    if (auto err = memory_manager->Free(map_frame, entry.bits.huge_page ? kFramesPer2MPage : 1)) {
+      return err;
+    }
+  }
+
+  return MAKE_ERROR(Error::kSuccess);
+}
+} // namespace
+
+Error CleanPageMaps(LinearAddress4Level addr) {
+  auto pml4_table = CurrentPML4();
+  if (!pml4_table[addr.parts.pml4].bits.present) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  auto pdp_table = pml4_table[addr.parts.pml4].Pointer();
+  pml4_table[addr.parts.pml4].data = 0;
+  if (auto err = CleanPageMap(pdp_table, 3)) {
+    return err;
+  }
+  return FreePageMap(pdp_table);
+}
+
+namespace {
+// the level 1 entry mapping addr, or nullptr if one of the tables on the way is missing
+PageMapEntry *FindPageEntry(LinearAddress4Level addr) {
+  auto page_map = CurrentPML4();
+  for (int level = 4; level > 1; --level) {
+    const auto entry = page_map[addr.Part(level)];
+    if (!entry.bits.present || entry.bits.huge_page) {
+      return nullptr;
+    }
+    page_map = entry.Pointer();
+  }
+  return &page_map[addr.Part(1)];
+}
+} // namespace
+
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages) {
+  for (size_t i = 0; i < num_4kpages; ++i, addr.value += kPageSize4K) {
+    auto entry = FindPageEntry(addr);
+    if (entry == nullptr || !entry->bits.present) {
+      continue;
+    }
+
+    const FrameID frame{reinterpret_cast<uintptr_t>(entry->Pointer()) / kBytesPerFrame};
+    entry->data = 0;
+    InvalidateTLB(addr.value);
+    if (auto err = memory_manager->Free(frame, 1)) {
+      return err;
+    }
+  }
+
+  // other PCIDs may still cache the mapping, and invlpg only reaches the current one
+  if (cr3_no_flush_mask != 0 && num_4kpages > 0) {
+    FlushAllTLB();
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MapSharedPage(LinearAddress4Level addr, FrameID frame) {
+  auto [entry, err] = SetupPageEntry(addr, 1);
+  if (err) {
+    return err;
+  }
+
+  entry->data = 0;
+  entry->SetPointer(reinterpret_cast<PageMapEntry *>(frame.Frame()));
+  entry->bits.present = 1;
+  entry->bits.user = 1;
+  entry->bits.shared = 1;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+namespace {
+// copies the file bytes of every segment overlapping [begin, end) into that freshly mapped range
+void FillFromSegments(const std::vector<AppSegment> &segments, uint64_t begin, uint64_t end) {
+  for (const auto &seg : segments) {
+    const auto copy_begin = std::max(begin, seg.vaddr_begin);
+    const auto copy_end = std::min({end, seg.vaddr_end, seg.vaddr_begin + seg.file_bytes});
+    if (copy_begin < copy_end) {
+      memcpy(reinterpret_cast<void *>(copy_begin), seg.file_data + (copy_begin - seg.vaddr_begin), copy_end - copy_begin);
+    }
+  }
+}
+} // namespace
+
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
+  if (error_code & 1) {
+    // the page is there but the access is not allowed
+    return MAKE_ERROR(Error::kBadAddress);
+  }
+
+  const auto &segments = task_manager->CurrentTask().Segments();
+
+  for (const auto &seg : segments) {
+    if (seg.stack && seg.vaddr_begin - kPageSize4K <= causal_addr && causal_addr < seg.vaddr_begin) {
+      printk("stack overflow: %lx\n", causal_addr);
+      return MAKE_ERROR(Error::kBadAddress);
+    }
+  }
+
+  // a 2 MiB block lying entirely inside one segment is mapped with a single huge page;
+  // stacks only get what they touch
+  const auto block_begin = causal_addr & ~(kPageSize2M - 1);
+  const auto block_end = block_begin + kPageSize2M;
+  if (std::any_of(segments.begin(), segments.end(), [&](const AppSegment &seg) {
+        return !seg.stack && seg.vaddr_begin <= block_begin && block_end <= seg.vaddr_end;
+      })) {
+    auto [entry, err] = SetupPageEntry(LinearAddress4Level{block_begin}, 2);
+    if (err) {
+      return err;
+    }
+    if (SetupHugePage(*entry)) {
+      FillFromSegments(segments, block_begin, block_end);
+      return MAKE_ERROR(Error::kSuccess);
+    }
+  }
+
+  // segments need not be page aligned, so a page may take data from more than one
+  const auto page_begin = causal_addr & ~(kPageSize4K - 1);
+  const auto page_end = page_begin + kPageSize4K;
+  if (std::none_of(segments.begin(), segments.end(), [&](const AppSegment &seg) {
+        return seg.vaddr_begin < page_end && page_begin < seg.vaddr_end;
+      })) {
+    return MAKE_ERROR(Error::kBadAddress);
+  }
+
+  if (auto err = SetupPageMaps(LinearAddress4Level{page_begin}, 1)) {
+    return err;
+  }
+  FillFromSegments(segments, page_begin, page_end);
+  return MAKE_ERROR(Error::kSuccess);
 }
@@ -1,4 +1,7 @@
 #pragma once
+#include "error.hpp"
+#include "frame_buffer_config.hpp"
+#include "memory_manager.hpp"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -67,7 +70,8 @@ union PageMapEntry {
     uint64_t dirty : 1;
     uint64_t huge_page : 1;
     uint64_t global : 1;
-    uint64_t : 3;
+    uint64_t shared : 1; // ignored by the CPU; the frame is not owned by this page map
+    uint64_t : 2;
 
     uint64_t addr : 40;
     uint64_t : 12;
@@ -82,8 +86,48 @@ union PageMapEntry {
   }
 };
 
+// Set to CR3 bit 63 once PCIDs are enabled, so that switching page maps keeps the TLB entries
+// tagged with the incoming PCID. SetCR3 without it flushes them.
+extern "C" uint64_t cr3_no_flush_mask;
+
 void ResetCR3();
+PageMapEntry *CurrentPML4();
+
+// PCID 0 tags the kernel's own page map, and every page map gets 0 when PCIDs are not supported.
+WithError<uint16_t> AllocatePCID();
+void FreePCID(uint16_t pcid);
 
 void SetupIdentityPageTable();
+// With 1 GiB identity pages the static page directories left unused go back to memory_manager.
+void FreeUnusedPageDirectories();
+// Maps the framebuffer write-combining through the PAT, splitting a 1 GiB identity page if needed.
+void MapFrameBufferWriteCombining(const FrameBufferConfig &config);
+// Switches the framebuffer between write-combining and uncached on the calling CPU only.
+// Returns false if it is not mapped through the PAT.
+bool SetFrameBufferWriteCombining(bool enable);
+uint64_t IdentityPageBytes();
 
 void InitializePaging();
+// Loads the kernel's page map on an AP with the BSP's paging features and PAT.
+void InitializePagingForAP();
+
+// Page maps come zeroed, from the ones apps gave back when possible.
+WithError<PageMapEntry *> NewPageMap();
+// Takes back a page map from NewPageMap. All its entries must be zero.
+Error FreePageMap(PageMapEntry *page_map);
+
+struct PageMapCacheStats {
+  size_t frames, hits, misses;
+};
+PageMapCacheStats GetPageMapCacheStats();
+
+// Maps num_4kpages fresh frames from addr in the current page map.
+// user selects whether the new entries are reachable from ring 3.
+Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool user = true);
+Error CleanPageMaps(LinearAddress4Level addr);
+// Maps addr to frame read-only for ring 3. CleanPageMaps leaves the frame to its owner.
+Error MapSharedPage(LinearAddress4Level addr, FrameID frame);
+// Maps the page at causal_addr if it falls in one of the current task's segments.
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+// Frees the frames behind num_4kpages pages from addr, leaving the page tables in place.
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages);
@@ -3,13 +3,15 @@
 #include "interrupt.hpp"
 #include "memory_manager.hpp"
 #include "printk.hpp"
+#include "smp.hpp"
 #include <array>
 
 namespace {
-std::array<SegmentDescriptor, 7> gdt;
-std::array<uint32_t, 26> tss;
+using TaskStateSegment = std::array<uint32_t, 26>;
 
-static_assert((kTSS >> 3) + 1 < gdt.size());
+// every CPU has its own TSS and a descriptor pair for it, starting at kTSS
+std::array<SegmentDescriptor, (kTSS >> 3) + 2 * kMaxCPUs> gdt;
+std::array<TaskStateSegment, kMaxCPUs> tss_by_cpu;
 } // namespace
 
 void SetCodeSegment(SegmentDescriptor &desc, DescriptorType type, uint32_t descriptor_privilege_level, uint32_t base, uint32_t limit) {
@@ -53,7 +55,7 @@ void SetupSegments() {
   LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
 }
 
-void SetTSS(int index, uint64_t value) {
+void SetTSS(TaskStateSegment &tss, int index, uint64_t value) {
   tss[index] = value & 0xffffffff;
   tss[index + 1] = value >> 32;
 }
@@ -68,14 +70,17 @@ uint64_t AllocateStackArea(int num_4kframes) {
 }
 
 void InitializeTSS() {
-  SetTSS(1, AllocateStackArea(8));
-  SetTSS(7 + 2 * kISTForTimer, AllocateStackArea(8));
+  const int cpu = CurrentCPU();
+  auto &tss = tss_by_cpu[cpu];
+  SetTSS(tss, 1, AllocateStackArea(8));
+  SetTSS(tss, 7 + 2 * kISTForTimer, AllocateStackArea(8));
 
+  const int index = (kTSS >> 3) + 2 * cpu;
   uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
-  SetSystemSegment(gdt[5], DescriptorType::kTSSAvailable, 0, tss_addr & 0xffffffff, sizeof(tss) - 1);
-  gdt[6].data = tss_addr >> 32;
+  SetSystemSegment(gdt[index], DescriptorType::kTSSAvailable, 0, tss_addr & 0xffffffff, sizeof(tss) - 1);
+  gdt[index + 1].data = tss_addr >> 32;
 
-  LoadTR(kTSS);
+  LoadTR(index << 3);
 }
 
 void InitializeSegmentation() {
@@ -37,6 +37,7 @@ const uint16_t kTSS = 5 << 3;
 
 void SetupSegments();
 
+// Sets up the calling CPU's TSS with its own kernel and interrupt stacks.
 void InitializeTSS();
 
 void InitializeSegmentation();
@@ -0,0 +1,142 @@
+#include "slab.hpp"
+#include "memory_manager.hpp"
+#include "printk.hpp"
+#include "spinlock.hpp"
+#include <array>
+#include <new>
+
+#ifdef DISABLE_SLAB
+
+void *SlabAllocate(size_t size) {
+  return ::operator new(size);
+}
+
+void SlabFree(void *p, size_t size) {
+  ::operator delete(p);
+}
+
+void PrintSlabStats(FileDescriptor &out) {
+  PrintToFD(out, "slab allocator disabled\n");
+}
+
+#else
+
+namespace {
+const size_t kMinSlabObjectBytes = 16;
+const size_t kMaxSlabObjectBytes = kBytesPerFrame;
+
+class SlabCache {
+public:
+  explicit SlabCache(size_t object_size) : object_size_{object_size} {}
+
+  void *Allocate() {
+    if (free_list_ == nullptr && !Grow()) {
+      return nullptr;
+    }
+
+    auto object = free_list_;
+    free_list_ = object->next;
+    ++num_allocs_;
+    ++num_live_;
+    return object;
+  }
+
+  void Free(void *p) {
+    auto object = reinterpret_cast<FreeObject *>(p);
+    object->next = free_list_;
+    free_list_ = object;
+    --num_live_;
+  }
+
+  size_t ObjectSize() const { return object_size_; }
+  size_t NumAllocs() const { return num_allocs_; }
+  size_t NumLive() const { return num_live_; }
+  size_t NumFrames() const { return num_frames_; }
+
+private:
+  struct FreeObject {
+    FreeObject *next;
+  };
+
+  size_t object_size_;
+  FreeObject *free_list_{nullptr};
+  size_t num_allocs_{0}, num_live_{0}, num_frames_{0};
+
+  bool Grow() {
+    auto [frame, err] = memory_manager->Allocate(1);
+    if (err) {
+      return false;
+    }
+    ++num_frames_;
+
+    auto base = reinterpret_cast<uint8_t *>(frame.Frame());
+    for (size_t offset = 0; offset + object_size_ <= kBytesPerFrame; offset += object_size_) {
+      auto object = reinterpret_cast<FreeObject *>(base + offset);
+      object->next = free_list_;
+      free_list_ = object;
+    }
+    return true;
+  }
+};
+
+std::array<SlabCache, 9> caches{
+    SlabCache{16}, SlabCache{32}, SlabCache{64}, SlabCache{128}, SlabCache{256},
+    SlabCache{512}, SlabCache{1024}, SlabCache{2048}, SlabCache{4096}};
+static_assert(kMinSlabObjectBytes << (caches.size() - 1) == kMaxSlabObjectBytes);
+SpinLock slab_lock;
+
+SlabCache &CacheFor(size_t size) {
+  size_t index = 0;
+  while ((kMinSlabObjectBytes << index) < size) {
+    ++index;
+  }
+  return caches[index];
+}
+} // namespace
+
+void *SlabAllocate(size_t size) {
+  if (size > kMaxSlabObjectBytes) {
+    return ::operator new(size);
+  }
+
+  // like operator new, retries for as long as a new handler is there to free memory
+  while (true) {
+    // slab_lock masks interrupts, so a CPU is never switched away while holding the caches
+    slab_lock.Lock();
+    void *p = CacheFor(size).Allocate();
+    slab_lock.Unlock();
+    if (p) {
+      return p;
+    }
+
+    auto handler = std::get_new_handler();
+    if (!handler) {
+      printk("slab: out of memory for a %lu-byte object\n", size);
+      exit(1);
+    }
+    handler();
+  }
+}
+
+void SlabFree(void *p, size_t size) {
+  if (p == nullptr) {
+    return;
+  }
+  if (size > kMaxSlabObjectBytes) {
+    ::operator delete(p);
+    return;
+  }
+
+  slab_lock.Lock();
+  CacheFor(size).Free(p);
+  slab_lock.Unlock();
+}
+
+void PrintSlabStats(FileDescriptor &out) {
+  PrintToFD(out, "size    allocs      live    frames\n");
+  for (const auto &cache : caches) {
+    PrintToFD(out, "%4lu %9lu %9lu %9lu\n", cache.ObjectSize(), cache.NumAllocs(), cache.NumLive(), cache.NumFrames());
+  }
+}
+
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "file.hpp"
+#include <memory>
+#include <stddef.h>
+#include <utility>
+
+// Objects up to one frame come from power-of-two size caches carved out of memory_manager frames.
+// The caller must pass the same size to SlabFree that it passed to SlabAllocate.
+void *SlabAllocate(size_t size);
+void SlabFree(void *p, size_t size);
+
+void PrintSlabStats(FileDescriptor &out);
+
+template <class T>
+class SlabAllocator {
+public:
+  using value_type = T;
+
+  SlabAllocator() = default;
+  template <class U>
+  SlabAllocator(const SlabAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(SlabAllocate(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t n) {
+    SlabFree(p, n * sizeof(T));
+  }
+};
+
+template <class T, class U>
+bool operator==(const SlabAllocator<T> &, const SlabAllocator<U> &) {
+  return true;
+}
+
+template <class T, class U>
+bool operator!=(const SlabAllocator<T> &, const SlabAllocator<U> &) {
+  return false;
+}
+
+// std::make_shared with the object and its control block in a slab
+template <class T, class... Args>
+std::shared_ptr<T> MakeShared(Args &&...args) {
+  return std::allocate_shared<T>(SlabAllocator<T>{}, std::forward<Args>(args)...);
+}
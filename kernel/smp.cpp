@@ -0,0 +1,180 @@
+#include "smp.hpp"
+#include "acpi.hpp"
+#include "asmfunc.hpp"
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "printk.hpp"
+#include "segment.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+#include <array>
+#include <atomic>
+#include <string.h>
+
+namespace {
+volatile uint32_t &lapic_id = *reinterpret_cast<uint32_t *>(0xfee00020);
+volatile uint32_t &icr_low = *reinterpret_cast<uint32_t *>(0xfee00300);
+volatile uint32_t &icr_high = *reinterpret_cast<uint32_t *>(0xfee00310);
+
+const uint32_t kICRInit = 0x00004500;
+const uint32_t kICRStartup = 0x00004600;
+const uint32_t kICRFixed = 0x00004000;
+const uint32_t kICRDeliveryPending = 1u << 12;
+
+// waits of the MP startup protocol
+const uint64_t kInitWaitNanos = 10'000'000;
+const uint64_t kStartupWaitNanos = 200'000;
+const uint64_t kAPTimeoutNanos = 1'000'000'000;
+const size_t kAPStackFrames = 8;
+
+// filled in right before the code is copied; must match the data at the end of APBootStart
+struct APBootData {
+  uint64_t cr3, stack, entry;
+};
+
+std::array<int, 256> cpu_index_by_apic_id{};
+std::array<uint8_t, kMaxCPUs> apic_id_by_cpu_index{};
+std::atomic<int> num_cpus{1};
+
+// the AP being started and StartAP race to move it out of kAPBooting
+enum APState { kAPBooting, kAPStarted, kAPCancelled };
+std::atomic<int> ap_state;
+
+void SendIPI(uint8_t apic_id, uint32_t command) {
+  icr_high = static_cast<uint32_t>(apic_id) << 24;
+  icr_low = command;
+  while (icr_low & kICRDeliveryPending) {
+    __builtin_ia32_pause();
+  }
+}
+
+void APMain() {
+  InitializeSegmentation();
+  InitializeInterruptForAP();
+  InitializePagingForAP();
+  InitializeTSS();
+  InitializeSyscall();
+  InitializeLAPICTimerForAP();
+
+  int booting = kAPBooting;
+  if (!ap_state.compare_exchange_strong(booting, kAPStarted, std::memory_order_acq_rel)) {
+    // StartAP gave up on this AP and is about to reset it with INIT
+    while (true) {
+      __asm__("cli\n\thlt");
+    }
+  }
+  task_manager->StartCPU();
+}
+
+bool StartAP(uint8_t apic_id, FrameID boot_frame) {
+  const int cpu = num_cpus.load(std::memory_order_relaxed);
+  auto [stack, err] = memory_manager->Allocate(kAPStackFrames);
+  if (err) {
+    printk("failed to allocate an AP stack: %s\n", err.Name());
+    return false;
+  }
+
+  const auto boot_code = reinterpret_cast<uint8_t *>(boot_frame.Frame());
+  const size_t boot_bytes = APBootEnd - APBootStart;
+  memcpy(boot_code, APBootStart, boot_bytes);
+  auto &data = *reinterpret_cast<APBootData *>(boot_code + boot_bytes - sizeof(APBootData));
+  data.cr3 = reinterpret_cast<uint64_t>(CurrentPML4());
+  data.stack = reinterpret_cast<uint64_t>(stack.Frame()) + kAPStackFrames * kBytesPerFrame - 8;
+  data.entry = reinterpret_cast<uint64_t>(APMain);
+
+  cpu_index_by_apic_id[apic_id] = cpu;
+  apic_id_by_cpu_index[cpu] = apic_id;
+  ap_state.store(kAPBooting, std::memory_order_relaxed);
+
+  SendIPI(apic_id, kICRInit);
+  WaitNanoseconds(kInitWaitNanos);
+  for (int i = 0; i < 2; ++i) {
+    SendIPI(apic_id, kICRStartup | boot_frame.ID());
+    WaitNanoseconds(kStartupWaitNanos);
+  }
+
+  const auto begin = NowNanoseconds();
+  while (ap_state.load(std::memory_order_acquire) == kAPBooting) {
+    int booting = kAPBooting;
+    if (NowNanoseconds() - begin > kAPTimeoutNanos &&
+        ap_state.compare_exchange_strong(booting, kAPCancelled, std::memory_order_acq_rel)) {
+      // INIT parks the AP wherever it got to, so it never runs on the stack or joins the scheduler
+      printk("AP %u did not start\n", apic_id);
+      SendIPI(apic_id, kICRInit);
+      memory_manager->Free(stack, kAPStackFrames);
+      cpu_index_by_apic_id[apic_id] = 0;
+      apic_id_by_cpu_index[cpu] = 0;
+      return false;
+    }
+    __builtin_ia32_pause();
+  }
+  num_cpus.store(cpu + 1, std::memory_order_release);
+  return true;
+}
+} // namespace
+
+int CurrentCPU() {
+  return cpu_index_by_apic_id[lapic_id >> 24];
+}
+
+int NumCPUs() {
+  return num_cpus.load(std::memory_order_acquire);
+}
+
+void StartAPs() {
+  const auto boot_frame = LowMemoryFrame();
+  if (acpi::madt == nullptr || boot_frame.ID() == kNullFrame.ID()) {
+    return;
+  }
+
+  const uint8_t bsp_apic_id = lapic_id >> 24;
+  apic_id_by_cpu_index[0] = bsp_apic_id;
+  bool failed = false;
+  acpi::madt->ForEachLocalAPIC([&](uint8_t apic_id) {
+    if (failed || apic_id == bsp_apic_id || NumCPUs() == kMaxCPUs) {
+      return;
+    }
+    // an AP that timed out is parked with INIT, but the ones after it are not tried either
+    failed = !StartAP(apic_id, boot_frame);
+  });
+  printk("%d CPUs online\n", NumCPUs());
+}
+
+void SendWakeupIPI(int cpu) {
+  SendIPI(apic_id_by_cpu_index[cpu], kICRFixed | InterruptVector::kWakeup);
+}
+
+namespace {
+std::atomic<int> malloc_owner{-1};
+int malloc_depth;
+uint64_t malloc_rflags;
+} // namespace
+
+// newlib calls these around malloc and free; the lock is recursive since free may run inside malloc
+extern "C" void __malloc_lock(struct _reent *) {
+  const auto rflags = DisableInterrupts();
+  const int cpu = CurrentCPU();
+  if (malloc_owner.load(std::memory_order_relaxed) == cpu) {
+    ++malloc_depth;
+    return;
+  }
+
+  int unlocked = -1;
+  while (!malloc_owner.compare_exchange_weak(unlocked, cpu, std::memory_order_acquire)) {
+    unlocked = -1;
+    __builtin_ia32_pause();
+  }
+  malloc_depth = 1;
+  malloc_rflags = rflags;
+}
+
+extern "C" void __malloc_unlock(struct _reent *) {
+  if (--malloc_depth > 0) {
+    return;
+  }
+  const auto rflags = malloc_rflags;
+  malloc_owner.store(-1, std::memory_order_release);
+  RestoreInterrupts(rflags);
+}
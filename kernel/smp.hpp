@@ -0,0 +1,14 @@
+#pragma once
+
+const int kMaxCPUs = 16;
+
+// Index of the calling CPU: 0 for the BSP, then the APs in the order they started.
+int CurrentCPU();
+int NumCPUs();
+
+// Starts the APs listed in the MADT one at a time. Each sets up its own descriptor tables,
+// TSS and LAPIC timer, then joins task_manager as an idle CPU.
+void StartAPs();
+
+// Interrupts an idle CPU so that it picks up a task woken onto its run queue.
+void SendWakeupIPI(int cpu);
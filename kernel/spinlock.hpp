@@ -0,0 +1,40 @@
+#pragma once
+
+#include "interrupt.hpp"
+#include <atomic>
+
+// Busy-waiting lock for data shared between CPUs. Interrupts stay masked on the holding CPU,
+// so an interrupt handler never spins on a lock its own CPU already holds.
+class SpinLock {
+public:
+  void Lock() {
+    const auto rflags = DisableInterrupts();
+    while (locked_.exchange(true, std::memory_order_acquire)) {
+      while (locked_.load(std::memory_order_relaxed)) {
+        __builtin_ia32_pause();
+      }
+    }
+    rflags_ = rflags;
+  }
+
+  void Unlock() {
+    const auto rflags = rflags_;
+    locked_.store(false, std::memory_order_release);
+    RestoreInterrupts(rflags);
+  }
+
+private:
+  std::atomic<bool> locked_{false};
+  uint64_t rflags_;
+};
+
+class SpinLockGuard {
+public:
+  explicit SpinLockGuard(SpinLock &lock) : lock_{lock} { lock_.Lock(); }
+  ~SpinLockGuard() { lock_.Unlock(); }
+  SpinLockGuard(const SpinLockGuard &) = delete;
+  SpinLockGuard &operator=(const SpinLockGuard &) = delete;
+
+private:
+  SpinLock &lock_;
+};
@@ -4,7 +4,9 @@
 #include "msr.hpp"
 #include "printk.hpp"
 #include "segment.hpp"
+#include "slab.hpp"
 #include "task.hpp"
+#include "timer.hpp"
 #include <array>
 #include <cerrno>
 #include <fcntl.h>
@@ -91,7 +93,7 @@ SYSCALL(open) {
   }
 
   size_t fd = task.AllocateFD();
-  task.Files()[fd] = std::make_unique<fat::FileDescriptor>(*file);
+  task.Files()[fd] = MakeShared<fat::FileDescriptor>(*file);
   return {fd, 0};
 }
 
@@ -102,16 +104,81 @@ SYSCALL(exit) {
   return {task.OSStackPointer(), static_cast<int>(arg1)};
 }
 
+// Blocks for at least arg1 nanoseconds. Other wakeups of the task, such as key presses
+// reaching the terminal, only send it back to sleep.
+SYSCALL(sleep) {
+  const uint64_t nsec = arg1;
+  if (nsec == 0) {
+    return {0, 0};
+  }
+
+  __asm__("cli");
+  auto &task = task_manager->CurrentTask();
+  __asm__("sti");
+
+  // the current tick is partly over, so one more makes the sleep long enough
+  const auto timeout = timer_manager->CurrentTick() + NanosecondsToTicks(nsec) + 1;
+  timer_manager->AddTimer(Timer{timeout, 0, task.ID()}.SetWakeupOnly());
+  while (timer_manager->CurrentTick() < timeout) {
+    task.Sleep();
+  }
+  return {0, 0};
+}
+
+// Makes a timer that fires every arg1 nanoseconds for wait_timer, replacing the app's previous one.
+// A period of 0 stops the timer.
+SYSCALL(periodic_timer) {
+  const uint64_t period_nsec = arg1;
+  __asm__("cli");
+  auto &task = task_manager->CurrentTask();
+  __asm__("sti");
+
+  auto &timer = task.PeriodicTimer();
+  if (timer) {
+    timer_manager->CancelTimer(*timer);
+    timer.reset();
+  }
+  if (period_nsec == 0) {
+    return {0, 0};
+  }
+
+  const auto period = NanosecondsToTicks(period_nsec);
+  timer = timer_manager->AddTimer(
+      Timer{timer_manager->CurrentTick() + period, 0, task.ID()}.SetPeriod(period).SetWakeupOnly());
+  return {0, 0};
+}
+
+// Blocks until the periodic timer fires and returns how many periods passed since the last wait_timer.
+SYSCALL(wait_timer) {
+  __asm__("cli");
+  auto &task = task_manager->CurrentTask();
+  __asm__("sti");
+
+  const auto timer = task.PeriodicTimer();
+  if (!timer) {
+    return {0, EINVAL};
+  }
+  while (true) {
+    if (const auto expirations = timer_manager->TakeExpirations(*timer)) {
+      return {expirations, 0};
+    }
+    task.Sleep();
+  }
+}
+
 } // namespace syscall
 
 using SyscallFuncType = syscall::Result(uint64_t, uint64_t, uint64_t,
                                         uint64_t, uint64_t, uint64_t);
 
-extern "C" std::array<SyscallFuncType *, 4> syscall_table{
+extern "C" std::array<SyscallFuncType *, 7> syscall_table{
     /* 0x00 */ syscall::read,
     /* 0x01 */ syscall::write,
     /* 0x02 */ syscall::open,
     /* 0x03 */ syscall::exit,
+    /* 0x04 */ syscall::sleep,
+    /* 0x05 */ syscall::periodic_timer,
+    /* 0x06 */ syscall::wait_timer,
 };
 
 void InitializeSyscall() {
@@ -1,5 +1,8 @@
 #include "task.hpp"
 #include "asmfunc.hpp"
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
 #include "printk.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
@@ -7,15 +10,32 @@
 #include <string.h>
 
 namespace {
-template <class T, class U>
-void Erase(T &c, const U &value) {
-  auto it = std::remove(c.begin(), c.end(), value);
-  c.erase(it, c.end());
+const size_t kInitialTaskSlots = 64;
+// timer switches between two attempts of a busy CPU to push a task away
+const int kBalancePeriod = 4;
+
+Task &PlaceTask(std::vector<std::unique_ptr<Task>> &slots, std::unique_ptr<Task> task) {
+  const size_t mask = slots.size() - 1;
+  size_t i = task->ID() & mask;
+  while (slots[i]) {
+    i = (i + 1) & mask;
+  }
+  return *(slots[i] = std::move(task));
 }
 
+// sti and hlt back to back let no wakeup IPI in between
 void TaskIdle(uint64_t task_id, int64_t data) {
-  while (true)
-    __asm__("hlt");
+  while (true) {
+    __asm__("cli");
+    task_manager->Yield();
+    if (RefillZeroedPool()) {
+      __asm__("sti");
+      continue;
+    }
+    EnterTicklessIdle();
+    __asm__("sti\n\thlt");
+    ExitTicklessIdle();
+  }
 }
 } // namespace
 
@@ -55,14 +75,35 @@ unsigned int Task::Level() const {
   return level_;
 }
 
+int Task::CPU() const {
+  return cpu_;
+}
+
+Task &Task::Pin() {
+  pinned_ = true;
+  return *this;
+}
+
 uint64_t &Task::OSStackPointer() {
   return os_stack_ptr_;
 }
 
+uint16_t &Task::PCID() {
+  return pcid_;
+}
+
 std::vector<std::shared_ptr<::FileDescriptor>> &Task::Files() {
   return files_;
 }
 
+std::vector<AppSegment> &Task::Segments() {
+  return segments_;
+}
+
+std::optional<TimerHandle> &Task::PeriodicTimer() {
+  return periodic_timer_;
+}
+
 bool Task::Running() const {
   return running_;
 }
@@ -77,21 +118,28 @@ Task &Task::Wakeup() {
   return *this;
 }
 
-void Task::SendMessage(const Message &msg) {
-  msgs_.push_back(msg);
+Error Task::SendMessage(const Message &msg) {
+  const bool pushed = msgs_.Push(msg);
   Wakeup();
+  return MAKE_ERROR(pushed ? Error::kSuccess : Error::kFull);
 }
 
 std::optional<Message> Task::ReceiveMessage() {
-  if (msgs_.empty()) {
+  Message m;
+  if (msgs_.Pop(&m, 1) == 0) {
     return std::nullopt;
   }
-
-  auto m = msgs_.front();
-  msgs_.pop_front();
   return m;
 }
 
+size_t Task::ReceiveMessages(Message *msgs, size_t max_msgs) {
+  return msgs_.Pop(msgs, max_msgs);
+}
+
+size_t Task::DroppedMessages() const {
+  return msgs_.Dropped();
+}
+
 size_t Task::AllocateFD() {
   const size_t num_files = files_.size();
   for (size_t i = 0; i < num_files; ++i) {
@@ -103,60 +151,281 @@ size_t Task::AllocateFD() {
   return num_files;
 }
 
-TaskManager::TaskManager() {
-  Task &task = NewTask().SetLevel(current_level_).SetRunning(true);
-  running_[current_level_].push_back(&task);
+void TaskManager::RunQueue::PushFront(Task *task) {
+  task->run_prev_ = nullptr;
+  task->run_next_ = front_;
+  if (front_) {
+    front_->run_prev_ = task;
+  } else {
+    back_ = task;
+  }
+  front_ = task;
+}
+
+void TaskManager::RunQueue::PushBack(Task *task) {
+  task->run_prev_ = back_;
+  task->run_next_ = nullptr;
+  if (back_) {
+    back_->run_next_ = task;
+  } else {
+    front_ = task;
+  }
+  back_ = task;
+}
+
+void TaskManager::RunQueue::Remove(Task *task) {
+  if (task->run_prev_) {
+    task->run_prev_->run_next_ = task->run_next_;
+  } else {
+    front_ = task->run_next_;
+  }
+  if (task->run_next_) {
+    task->run_next_->run_prev_ = task->run_prev_;
+  } else {
+    back_ = task->run_prev_;
+  }
+  task->run_prev_ = task->run_next_ = nullptr;
+}
+
+TaskManager::TaskManager() : task_slots_(kInitialTaskSlots) {
+  auto &cpu = cpus_[0];
+  Task &task = NewTask().SetLevel(cpu.current_level).SetRunning(true);
+  Enqueue(cpu, &task);
+  cpu.current = &task;
 
   Task &idle = NewTask().InitContext(TaskIdle, 0).SetLevel(0).SetRunning(true);
-  running_[0].push_back(&idle);
+  Enqueue(cpu, &idle);
+  cpu.idle = &idle;
 }
 
 Task &TaskManager::NewTask() {
+  SpinLockGuard guard{lock_};
   ++latest_id_;
-  return *tasks_.emplace_back(new Task{latest_id_});
+  Task &task = InsertTask(std::unique_ptr<Task>{new Task{latest_id_}});
+  task.cpu_ = CurrentCPU();
+  return task;
+}
+
+Task *TaskManager::FindTask(uint64_t id) {
+  const size_t mask = task_slots_.size() - 1;
+  for (size_t i = id & mask; task_slots_[i]; i = (i + 1) & mask) {
+    if (task_slots_[i]->ID() == id) {
+      return task_slots_[i].get();
+    }
+  }
+  return nullptr;
+}
+
+// grows the table here, in task context, so that lookups from interrupt handlers never allocate
+Task &TaskManager::InsertTask(std::unique_ptr<Task> task) {
+  if (2 * (num_tasks_ + 1) > task_slots_.size()) {
+    std::vector<std::unique_ptr<Task>> slots(2 * task_slots_.size());
+    for (auto &t : task_slots_) {
+      if (t) {
+        PlaceTask(slots, std::move(t));
+      }
+    }
+    task_slots_.swap(slots);
+  }
+
+  ++num_tasks_;
+  return PlaceTask(task_slots_, std::move(task));
+}
+
+// backward shift deletion: later entries of the probe run move up so that no tombstones are needed
+std::unique_ptr<Task> TaskManager::EraseTask(uint64_t id) {
+  const size_t mask = task_slots_.size() - 1;
+  size_t hole = id & mask;
+  while (task_slots_[hole]->ID() != id) {
+    hole = (hole + 1) & mask;
+  }
+  auto task = std::move(task_slots_[hole]);
+  --num_tasks_;
+
+  for (size_t i = (hole + 1) & mask; task_slots_[i]; i = (i + 1) & mask) {
+    const size_t home = task_slots_[i]->ID() & mask;
+    // the entry may fill the hole unless its home lies cyclically in (hole, i]
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      task_slots_[hole] = std::move(task_slots_[i]);
+      hole = i;
+    }
+  }
+  return task;
 }
 
 void TaskManager::SwitchTask(const TaskContext &current_ctx) {
-  TaskContext &task_ctx = this->CurrentTask().Context();
-  memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
-  Task *current_task = RotateCurrentRunQueue(false);
-  if (&CurrentTask() != current_task) {
-    RestoreContext(&CurrentTask().Context());
+  lock_.Lock();
+  const int cpu_index = CurrentCPU();
+  auto &cpu = cpus_[cpu_index];
+  cpu.leaving = nullptr;
+  if (++cpu.ticks_since_balance >= kBalancePeriod) {
+    cpu.ticks_since_balance = 0;
+    PushLocked(cpu_index);
+  }
+
+  Task *current_task = cpu.current;
+  memcpy(&current_task->Context(), &current_ctx, sizeof(TaskContext));
+  // a task put to sleep from another CPU leaves the queue here
+  RotateCurrentRunQueue(cpu, !current_task->Running());
+  Task *next_task = cpu.running[cpu.current_level].Front();
+  cpu.current = next_task;
+  if (next_task != current_task) {
+    PrepareToRun(next_task);
+  }
+  UpdatePreemptionTick(cpu);
+  lock_.Unlock();
+
+  if (next_task != current_task) {
+    RestoreContext(&next_task->Context());
   }
 }
 
 Task &TaskManager::CurrentTask() {
-  return *running_[current_level_].front();
+  const auto rflags = DisableInterrupts();
+  Task *task = cpus_[CurrentCPU()].current;
+  RestoreInterrupts(rflags);
+  return *task;
+}
+
+void TaskManager::StartCPU() {
+  lock_.Lock();
+  const int cpu_index = CurrentCPU();
+  ++latest_id_;
+  Task &idle = InsertTask(std::unique_ptr<Task>{new Task{latest_id_}}).SetLevel(0).SetRunning(true);
+  idle.cpu_ = cpu_index;
+
+  // tasks may have been placed here already; the first Yield picks them up
+  auto &cpu = cpus_[cpu_index];
+  Enqueue(cpu, &idle, true);
+  cpu.idle = &idle;
+  cpu.current = &idle;
+  cpu.current_level = 0;
+  cpu.level_changed = true;
+  UpdatePreemptionTick(cpu);
+  lock_.Unlock();
+
+  TaskIdle(idle.ID(), 0);
+  while (true) {
+    __asm__("hlt");
+  }
+}
+
+void TaskManager::Yield() {
+  const auto rflags = DisableInterrupts();
+  lock_.Lock();
+  const int cpu_index = CurrentCPU();
+  auto &cpu = cpus_[cpu_index];
+  cpu.leaving = nullptr;
+  if (Load(cpu) == 0) {
+    StealLocked(cpu_index);
+  }
+  if (!cpu.level_changed) {
+    UpdatePreemptionTick(cpu);
+    lock_.Unlock();
+    RestoreInterrupts(rflags);
+    return;
+  }
+
+  Task *current_task = cpu.current;
+  RotateCurrentRunQueue(cpu, false);
+  SwitchFromCurrent(cpu, current_task);
+  RestoreInterrupts(rflags);
+}
+
+// called with lock_ held and interrupts masked; drops the lock, which stays dropped when the task runs again
+void TaskManager::SwitchFromCurrent(CPUQueues &cpu, Task *current_task) {
+  Task *next_task = cpu.running[cpu.current_level].Front();
+  cpu.current = next_task;
+  if (next_task != current_task) {
+    cpu.leaving = current_task;
+    PrepareToRun(next_task);
+  }
+  UpdatePreemptionTick(cpu);
+  lock_.Unlock();
+
+  if (next_task != current_task) {
+    SwitchContext(&next_task->Context(), &current_task->Context());
+  }
+}
+
+// a CR3 load without the no-flush bit drops what this CPU cached under the task's PCID
+void TaskManager::PrepareToRun(Task *task) {
+  if (task->flush_tlb_) {
+    task->flush_tlb_ = false;
+    if (cr3_no_flush_mask != 0) {
+      SetCR3(task->Context().cr3);
+    }
+  }
 }
 
 void TaskManager::Sleep(Task *task) {
+  const auto rflags = DisableInterrupts();
+  lock_.Lock();
+  SleepLocked(task);
+  lock_.Unlock();
+  RestoreInterrupts(rflags);
+}
+
+Error TaskManager::Sleep(uint64_t id) {
+  const auto rflags = DisableInterrupts();
+  lock_.Lock();
+  Task *task = FindTask(id);
+  if (task) {
+    SleepLocked(task);
+  }
+  lock_.Unlock();
+  RestoreInterrupts(rflags);
+  return MAKE_ERROR(task ? Error::kSuccess : Error::kNoSuchTask);
+}
+
+// called with lock_ held and interrupts masked; a task that puts itself to sleep holds the lock again when woken
+void TaskManager::SleepLocked(Task *task) {
+  if (task->wakeup_pending_) {
+    task->wakeup_pending_ = false;
+    return;
+  }
   if (!task->Running()) {
     return;
   }
 
   task->SetRunning(false);
-
-  if (task == running_[current_level_].front()) {
-    Task *current_task = RotateCurrentRunQueue(true);
-    SwitchContext(&CurrentTask().Context(), &current_task->Context());
+  auto &cpu = cpus_[task->cpu_];
+  if (task != cpu.current) {
+    Dequeue(cpu, task);
+    return;
+  }
+  if (task->cpu_ != CurrentCPU()) {
+    Kick(task->cpu_);
     return;
   }
 
-  Erase(running_[task->Level()], task);
+  RotateCurrentRunQueue(cpu, true);
+  SwitchFromCurrent(cpu, task);
+  lock_.Lock();
 }
 
-Error TaskManager::Sleep(uint64_t id) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto &t) { return t->ID() == id; });
-  if (it == tasks_.end()) {
+void TaskManager::Wakeup(Task *task, int level) {
+  SpinLockGuard guard{lock_};
+  WakeupLocked(task, level);
+}
+
+Error TaskManager::Wakeup(uint64_t id, int level) {
+  SpinLockGuard guard{lock_};
+  Task *task = FindTask(id);
+  if (!task) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Sleep(it->get());
+  WakeupLocked(task, level);
   return MAKE_ERROR(Error::kSuccess);
 }
 
-void TaskManager::Wakeup(Task *task, int level) {
-  if (task->Running()) {
+// a wakeup racing with the task's own check before Sleep on another CPU is kept in wakeup_pending_
+void TaskManager::WakeupLocked(Task *task, int level) {
+  auto &cpu = cpus_[task->cpu_];
+  if (task->Running() || task == cpu.current) {
+    task->wakeup_pending_ = task->Running();
+    task->SetRunning(true);
     ChangeLevelRunning(task, level);
     return;
   }
@@ -168,30 +437,23 @@ void TaskManager::Wakeup(Task *task, int level) {
   task->SetLevel(level);
   task->SetRunning(true);
 
-  running_[level].push_back(task);
-  if (level > current_level_) {
-    level_changed_ = true;
+  Enqueue(cpu, task);
+  if (level > cpu.current_level) {
+    cpu.level_changed = true;
   }
-}
-
-Error TaskManager::Wakeup(uint64_t id, int level) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto &t) { return t->ID() == id; });
-  if (it == tasks_.end()) {
-    return MAKE_ERROR(Error::kNoSuchTask);
-  }
-
-  Wakeup(it->get(), level);
-  return MAKE_ERROR(Error::kSuccess);
+  Kick(task->cpu_);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message &msg) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto &t) { return t->ID() == id; });
-  if (it == tasks_.end()) {
+  SpinLockGuard guard{lock_};
+  Task *task = FindTask(id);
+  if (!task) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  (*it)->SendMessage(msg);
-  return MAKE_ERROR(Error::kSuccess);
+  const bool pushed = task->msgs_.Push(msg);
+  WakeupLocked(task, -1);
+  return MAKE_ERROR(pushed ? Error::kSuccess : Error::kFull);
 }
 
 void TaskManager::ChangeLevelRunning(Task *task, int level) {
@@ -199,47 +461,60 @@ void TaskManager::ChangeLevelRunning(Task *task, int level) {
     return;
   }
 
-  if (task != running_[current_level_].front()) {
-    Erase(running_[task->Level()], task);
-    running_[level].push_back(task);
-    task->SetLevel(level);
-    if (level > current_level_) {
-      level_changed_ = true;
+  auto &cpu = cpus_[task->cpu_];
+  Dequeue(cpu, task);
+  task->SetLevel(level);
+  if (task != cpu.current) {
+    Enqueue(cpu, task);
+    if (level > cpu.current_level) {
+      cpu.level_changed = true;
     }
+    Kick(task->cpu_);
     return;
   }
 
-  running_[current_level_].pop_front();
-  running_[level].push_front(task);
-  task->SetLevel(level);
-  if (level >= current_level_) {
-    current_level_ = level;
+  // the current task stays at the front
+  Enqueue(cpu, task, true);
+  if (level >= cpu.current_level) {
+    cpu.current_level = level;
   } else {
-    current_level_ = level;
-    level_changed_ = true;
+    cpu.current_level = level;
+    cpu.level_changed = true;
   }
+  Kick(task->cpu_);
 }
 
 void TaskManager::Finish(int exit_code) {
-  Task *current_task = RotateCurrentRunQueue(true);
+  DisableInterrupts();
+  lock_.Lock();
+  auto &cpu = cpus_[CurrentCPU()];
+  Task *current_task = cpu.current;
+  current_task->SetRunning(false);
+  RotateCurrentRunQueue(cpu, true);
 
   const auto task_id = current_task->ID();
-  auto it = std::find_if(tasks_.begin(), tasks_.end(), [current_task](const auto &t) { return t.get() == current_task; });
-  tasks_.erase(it);
+  cpu.finished = EraseTask(task_id);
 
   finish_tasks_[task_id] = exit_code;
   if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
     auto waiter = it->second;
     finish_waiter_.erase(it);
-    Wakeup(waiter);
+    WakeupLocked(waiter, -1);
   }
 
-  RestoreContext(&CurrentTask().Context());
+  Task *next_task = cpu.running[cpu.current_level].Front();
+  cpu.current = next_task;
+  PrepareToRun(next_task);
+  UpdatePreemptionTick(cpu);
+  lock_.Unlock();
+  RestoreContext(&next_task->Context());
 }
 
 WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
   int exit_code;
-  Task *current_task = &CurrentTask();
+  const auto rflags = DisableInterrupts();
+  lock_.Lock();
+  Task *current_task = cpus_[CurrentCPU()].current;
   while (true) {
     if (auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
       exit_code = it->second;
@@ -247,41 +522,155 @@ WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
       break;
     }
     finish_waiter_[task_id] = current_task;
-    Sleep(current_task);
+    SleepLocked(current_task);
   }
+  lock_.Unlock();
+  RestoreInterrupts(rflags);
   return {exit_code, MAKE_ERROR(Error::kSuccess)};
 }
 
-Task *TaskManager::RotateCurrentRunQueue(bool current_sleep) {
-  auto &level_queue = running_[current_level_];
-  Task *current_task = level_queue.front();
-  level_queue.pop_front();
+Task *TaskManager::RotateCurrentRunQueue(CPUQueues &cpu, bool current_sleep) {
+  Task *current_task = cpu.running[cpu.current_level].Front();
+  Dequeue(cpu, current_task);
   if (!current_sleep) {
-    level_queue.push_back(current_task);
+    Enqueue(cpu, current_task);
   }
-  if (level_queue.empty()) {
-    level_changed_ = true;
+
+  cpu.level_changed = false;
+  cpu.current_level = HighestLevel(cpu);
+  return current_task;
+}
+
+// files the task under its level, at the back unless front is set
+void TaskManager::Enqueue(CPUQueues &cpu, Task *task, bool front) {
+  auto &queue = cpu.running[task->Level()];
+  if (front) {
+    queue.PushFront(task);
+  } else {
+    queue.PushBack(task);
   }
+  cpu.ready_levels |= 1u << task->Level();
+  ++cpu.num_running;
+}
 
-  if (level_changed_) {
-    level_changed_ = false;
-    for (int lv = kMaxLevel; lv >= 0; --lv) {
-      if (!running_[lv].empty()) {
-        current_level_ = lv;
-        break;
+void TaskManager::Dequeue(CPUQueues &cpu, Task *task) {
+  auto &queue = cpu.running[task->Level()];
+  queue.Remove(task);
+  if (queue.Empty()) {
+    cpu.ready_levels &= ~(1u << task->Level());
+  }
+  --cpu.num_running;
+}
+
+// the idle task keeps level 0 occupied on a started CPU
+int TaskManager::HighestLevel(const CPUQueues &cpu) const {
+  return 31 - __builtin_clz(cpu.ready_levels);
+}
+
+// runnable tasks other than the idle task, the current one included
+size_t TaskManager::Load(const CPUQueues &cpu) const {
+  return cpu.idle ? cpu.num_running - 1 : cpu.num_running;
+}
+
+// the highest-level waiting task, which the CPU would run next among those it can give away
+Task *TaskManager::FindMigratable(CPUQueues &cpu) {
+  for (uint32_t levels = cpu.ready_levels; levels != 0;) {
+    const int lv = 31 - __builtin_clz(levels);
+    levels &= ~(1u << lv);
+    for (Task *task = cpu.running[lv].Back(); task; task = task->run_prev_) {
+      if (task != cpu.current && task != cpu.idle && task != cpu.leaving && !task->pinned_) {
+        return task;
       }
     }
   }
+  return nullptr;
+}
 
-  return current_task;
+void TaskManager::MigrateLocked(Task *task, int cpu_index) {
+  Dequeue(cpus_[task->cpu_], task);
+  task->cpu_ = cpu_index;
+  task->flush_tlb_ = true;
+
+  auto &cpu = cpus_[cpu_index];
+  Enqueue(cpu, task);
+  if (task->Level() > cpu.current_level) {
+    cpu.level_changed = true;
+  }
+  Kick(cpu_index);
+}
+
+void TaskManager::StealLocked(int cpu_index) {
+  int victim = -1;
+  size_t victim_load = 1;
+  for (int i = 0; i < NumCPUs(); ++i) {
+    if (const size_t load = Load(cpus_[i]); i != cpu_index && load > victim_load) {
+      victim = i;
+      victim_load = load;
+    }
+  }
+
+  if (victim >= 0) {
+    if (Task *task = FindMigratable(cpus_[victim])) {
+      MigrateLocked(task, cpu_index);
+    }
+  }
+}
+
+// moves one waiting task to the least loaded CPU when that evens the load out
+void TaskManager::PushLocked(int cpu_index) {
+  int target = -1;
+  size_t target_load = Load(cpus_[cpu_index]);
+  for (int i = 0; i < NumCPUs(); ++i) {
+    if (const size_t load = Load(cpus_[i]); cpus_[i].idle && load < target_load) {
+      target = i;
+      target_load = load;
+    }
+  }
+
+  if (target >= 0 && target_load + 2 <= Load(cpus_[cpu_index])) {
+    if (Task *task = FindMigratable(cpus_[cpu_index])) {
+      MigrateLocked(task, target);
+    }
+  }
+}
+
+// a CPU with one task to run has nothing to preempt, though it still ticks while others wait to be pushed away
+bool TaskManager::NeedsPreemption(const CPUQueues &cpu) const {
+  return cpu.level_changed || Load(cpu) > 1 || !cpu.current->Running();
+}
+
+// called on the CPU itself whenever it picks what to run
+void TaskManager::UpdatePreemptionTick(CPUQueues &cpu) {
+  if (const bool needed = NeedsPreemption(cpu); needed != cpu.ticking) {
+    cpu.ticking = needed;
+    SetPreemptionTick(needed);
+  }
+}
+
+// restarts the preemption tick of a CPU whose queues changed behind its back
+void TaskManager::Kick(int cpu_index) {
+  auto &cpu = cpus_[cpu_index];
+  if (cpu.ticking || !NeedsPreemption(cpu)) {
+    return;
+  }
+
+  if (cpu_index == CurrentCPU()) {
+    cpu.ticking = true;
+    SetPreemptionTick(true);
+  } else {
+    // the CPU switches from the IPI handler and sets the tick up itself
+    SendWakeupIPI(cpu_index);
+  }
 }
 
 TaskManager *task_manager;
 
 void InitializeTask() {
   task_manager = new TaskManager;
+}
 
-  __asm__("cli");
-  timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue});
-  __asm__("sti");
+void WakeupOnInterrupt(const TaskContext &ctx_stack) {
+  ExitTicklessIdle();
+  NotifyEndOfInterrupt();
+  task_manager->SwitchTask(ctx_stack);
 }
@@ -4,8 +4,11 @@
 #include "fat.hpp"
 #include "file.hpp"
 #include "message.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "timer.hpp"
 #include <array>
-#include <deque>
 #include <map>
 #include <memory>
 #include <optional>
@@ -21,6 +24,16 @@ struct TaskContext {
 
 using TaskFunc = void(uint64_t, int64_t);
 
+// Part of an app's address space that is mapped on first touch.
+// The first file_bytes bytes come from file_data and the rest are zero.
+// A stack grows down from vaddr_end page by page, and the page below vaddr_begin is its guard.
+struct AppSegment {
+  uint64_t vaddr_begin, vaddr_end;
+  const uint8_t *file_data;
+  uint64_t file_bytes;
+  bool stack;
+};
+
 class TaskManager;
 
 class Task {
@@ -30,19 +43,35 @@ public:
 
   Task(uint64_t id);
   Task &InitContext(TaskFunc *, int64_t data);
+
+  static void *operator new(size_t size) { return SlabAllocate(size); }
+  static void operator delete(void *p, size_t size) { SlabFree(p, size); }
+
   TaskContext &Context();
 
   uint64_t ID() const;
   unsigned int Level() const;
+  // the CPU whose run queues hold the task
+  int CPU() const;
+  // Keeps the task on the CPU it was created on; load balancing never moves it.
+  Task &Pin();
   uint64_t &OSStackPointer();
+  uint16_t &PCID();
   std::vector<std::shared_ptr<::FileDescriptor>> &Files();
+  std::vector<AppSegment> &Segments();
+  // the timer of the periodic_timer system call, if the app set one
+  std::optional<TimerHandle> &PeriodicTimer();
 
   bool Running() const;
   Task &Sleep();
   Task &Wakeup();
 
-  void SendMessage(const Message &msg);
+  // Wakes the task even when the message is dropped because the mailbox is full, which returns kFull.
+  Error SendMessage(const Message &msg);
   std::optional<Message> ReceiveMessage();
+  // Takes up to max_msgs messages at once and returns how many it took.
+  size_t ReceiveMessages(Message *msgs, size_t max_msgs);
+  size_t DroppedMessages() const;
 
   size_t AllocateFD();
 
@@ -50,11 +79,22 @@ private:
   uint64_t id_;
   std::vector<uint64_t> stack_;
   alignas(16) TaskContext context_;
-  std::deque<Message> msgs_;
+  MessageRing msgs_;
   unsigned int level_{kDefaultLevel};
   bool running_{false};
+  // set by a wakeup that finds the task running, so that its next Sleep returns at once
+  bool wakeup_pending_{false};
+  int cpu_{0};
+  bool pinned_{false};
+  // set when the task moves to another CPU, whose TLB may hold stale entries tagged with its PCID
+  bool flush_tlb_{false};
+  // links of the run queue that holds the task
+  Task *run_prev_{nullptr}, *run_next_{nullptr};
   uint64_t os_stack_ptr_;
+  uint16_t pcid_{0};
   std::vector<std::shared_ptr<::FileDescriptor>> files_{};
+  std::vector<AppSegment> segments_{};
+  std::optional<TimerHandle> periodic_timer_{};
 
   Task &SetLevel(int level) {
     level_ = level;
@@ -68,14 +108,22 @@ private:
   friend TaskManager;
 };
 
+// Every CPU has its own run queues and current task. A new task starts on the CPU that created it;
+// idle CPUs steal waiting tasks and busy ones push them away. One lock guards the task table and all the queues.
+// A bitmap of the non-empty levels finds the highest one in a single bsr, so no operation scans the queues.
 class TaskManager {
 public:
-  static const int kMaxLevel = 3;
+  static const int kMaxLevel = 31;
 
   TaskManager();
   Task &NewTask();
   void SwitchTask(const TaskContext &current_ctx);
   Task &CurrentTask();
+  // Makes the calling AP's boot flow its idle task and never returns.
+  [[noreturn]] void StartCPU();
+  // Gives the CPU to a higher-level task woken onto this CPU, if any. With nothing else to run,
+  // first steals a waiting task from the busiest CPU.
+  void Yield();
 
   void Sleep(Task *task);
   Error Sleep(uint64_t id);
@@ -88,18 +136,77 @@ public:
   WithError<int> WaitFinish(uint64_t task_id);
 
 private:
-  std::vector<std::unique_ptr<Task>> tasks_{};
+  // tasks linked through their own run_prev_ and run_next_, so removing one from the middle is O(1)
+  class RunQueue {
+  public:
+    Task *Front() const { return front_; }
+    Task *Back() const { return back_; }
+    bool Empty() const { return front_ == nullptr; }
+    void PushFront(Task *task);
+    void PushBack(Task *task);
+    void Remove(Task *task);
+
+  private:
+    Task *front_{nullptr}, *back_{nullptr};
+  };
+
+  struct CPUQueues {
+    std::array<RunQueue, kMaxLevel + 1> running{};
+    // bit L is set while running[L] holds a task
+    uint32_t ready_levels{0};
+    // tasks in running, the idle task included
+    size_t num_running{0};
+    int current_level{kMaxLevel};
+    bool level_changed{false};
+    // the front of running[current_level], kept apart so CurrentTask needs no lock
+    Task *current{nullptr};
+    // freed by the next Finish on this CPU, once nothing runs on its stack
+    std::unique_ptr<Task> finished;
+    Task *idle{nullptr};
+    // switched out with its context saved after the lock was dropped; it stays put until the CPU schedules again
+    Task *leaving{nullptr};
+    int ticks_since_balance{0};
+    // whether the CPU's timer preempts its current task
+    bool ticking{true};
+  };
+
+  SpinLock lock_;
+  // open addressing with linear probing; IDs are sequential, so a task's home slot is its ID modulo the table size
+  std::vector<std::unique_ptr<Task>> task_slots_;
+  size_t num_tasks_{0};
   uint64_t latest_id_{0};
-  std::array<std::deque<Task *>, kMaxLevel + 1> running_{};
-  int current_level_{kMaxLevel};
-  bool level_changed_{false};
+  std::array<CPUQueues, kMaxCPUs> cpus_{};
   std::map<uint64_t, int> finish_tasks_{};
   std::map<uint64_t, Task *> finish_waiter_{};
 
+  Task *FindTask(uint64_t id);
+  Task &InsertTask(std::unique_ptr<Task> task);
+  std::unique_ptr<Task> EraseTask(uint64_t id);
+
+  void SleepLocked(Task *task);
+  void WakeupLocked(Task *task, int level);
+  void SwitchFromCurrent(CPUQueues &cpu, Task *current_task);
   void ChangeLevelRunning(Task *task, int level);
-  Task *RotateCurrentRunQueue(bool current_sleep);
+  Task *RotateCurrentRunQueue(CPUQueues &cpu, bool current_sleep);
+  void PrepareToRun(Task *task);
+
+  void Enqueue(CPUQueues &cpu, Task *task, bool front = false);
+  void Dequeue(CPUQueues &cpu, Task *task);
+  int HighestLevel(const CPUQueues &cpu) const;
+
+  size_t Load(const CPUQueues &cpu) const;
+  Task *FindMigratable(CPUQueues &cpu);
+  void MigrateLocked(Task *task, int cpu_index);
+  void StealLocked(int cpu_index);
+  void PushLocked(int cpu_index);
+
+  bool NeedsPreemption(const CPUQueues &cpu) const;
+  void UpdatePreemptionTick(CPUQueues &cpu);
+  void Kick(int cpu_index);
 };
 
 extern TaskManager *task_manager;
 
 void InitializeTask();
+
+extern "C" void WakeupOnInterrupt(const TaskContext &ctx_stack);
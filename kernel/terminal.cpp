@@ -1,5 +1,7 @@
 #include "terminal.hpp"
+#include "app_image.hpp"
 #include "asmfunc.hpp"
+#include "benchmark.hpp"
 #include "console.hpp"
 #include "elf.hpp"
 #include "fat.hpp"
@@ -9,7 +11,9 @@
 #include "paging.hpp"
 #include "printk.hpp"
 #include "segment.hpp"
+#include "slab.hpp"
 #include "task.hpp"
+#include "timer.hpp"
 #include <string.h>
 #include <string>
 
@@ -17,6 +21,10 @@ namespace {
 
 int last_exit_code{0};
 
+// the stack sits right below the page holding argv and may grow to kAppStackBytes
+const uint64_t kAppStackEnd = 0xffff'ffff'ffff'f000;
+const uint64_t kAppStackBytes = APP_STACK_LIMIT_KIB * 1_KiB;
+
 WithError<int> MakeArgVector(char *cmd, char *first_arg, char **argv, int argv_len, char *argbuf, int argbuf_len) {
   int argc = 0;
   int argbuf_index = 0;
@@ -81,132 +89,21 @@ uintptr_t GetFirstLoadAddress(Elf64_Ehdr *ehdr) {
   return 0;
 }
 
-WithError<PageMapEntry *> NewPageMap() {
-  auto frame = memory_manager->Allocate(1);
-  if (frame.error) {
-    return {nullptr, frame.error};
-  }
-
-  auto e = reinterpret_cast<PageMapEntry *>(frame.value.Frame());
-  memset(e, 0, sizeof(uint64_t) * 512);
-  return {e, MAKE_ERROR(Error::kSuccess)};
-}
-
-WithError<PageMapEntry *> SetNewPageMapIfNotPresent(PageMapEntry &entry) {
-  if (entry.bits.present) {
-    return {entry.Pointer(), MAKE_ERROR(Error::kSuccess)};
-  }
-
-  auto [child_map, err] = NewPageMap();
-  if (err) {
-    return {nullptr, err};
-  }
-
-  entry.SetPointer(child_map);
-  entry.bits.present = 1;
-
-  return {child_map, MAKE_ERROR(Error::kSuccess)};
-}
-
-WithError<size_t> SetupPageMap(PageMapEntry *page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kpages) {
-  while (num_4kpages > 0) {
-    const auto entry_index = addr.Part(page_map_level);
-
-    auto [child_map, err] = SetNewPageMapIfNotPresent(page_map[entry_index]);
-    if (err) {
-      return {num_4kpages, err};
-    }
-    page_map[entry_index].bits.writable = 1;
-    page_map[entry_index].bits.user = 1;
-
-    if (page_map_level == 1) {
-      --num_4kpages;
-    } else {
-      auto [num_remain_pages, err] = SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages);
-      if (err) {
-        return {num_4kpages, err};
-      }
-      num_4kpages = num_remain_pages;
-    }
-
-    if (entry_index == 511) {
-      break;
-    }
-
-    addr.SetPart(page_map_level, entry_index + 1);
-    for (int level = page_map_level - 1; level >= 1; --level) {
-      addr.SetPart(level, 0);
-    }
-  }
-
-  return {num_4kpages, MAKE_ERROR(Error::kSuccess)};
-}
-
-Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages) {
-  auto pml4_table = reinterpret_cast<PageMapEntry *>(GetCR3());
-  return SetupPageMap(pml4_table, 4, addr, num_4kpages).error;
-}
-
-Error CleanPageMap(PageMapEntry *page_map, int page_map_level) {
-  for (int i = 0; i < 512; ++i) {
-    auto entry = page_map[i];
-    if (!entry.bits.present) {
-      continue;
-    }
-
-    if (page_map_level > 1) {
-      if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1)) {
-        return err;
-      }
-    }
-
-    const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
-    const FrameID map_frame{entry_addr / kBytesPerFrame};
-    if (auto err = memory_manager->Free(map_frame, 1)) {
-      return err;
-    }
-    page_map[i].data = 0;
-  }
-
-  return MAKE_ERROR(Error::kSuccess);
-}
-
-Error CleanPageMaps(LinearAddress4Level addr) {
-  auto pml4_table = reinterpret_cast<PageMapEntry *>(GetCR3());
-  auto pdp_table = pml4_table[addr.parts.pml4].Pointer();
-  pml4_table[addr.parts.pml4].data = 0;
-  if (auto err = CleanPageMap(pdp_table, 3)) {
-    return err;
-  }
-
-  const auto pdp_addr = reinterpret_cast<uintptr_t>(pdp_table);
-  const FrameID pdp_frame{pdp_addr / kBytesPerFrame};
-  return memory_manager->Free(pdp_frame, 1);
-}
-
-Error CopyLoadSegments(Elf64_Ehdr *ehdr) {
+// Pages are mapped and filled by the page fault handler on first touch,
+// so ehdr must stay alive while the app runs.
+void RecordLoadSegments(Elf64_Ehdr *ehdr, Task &task) {
   auto phdr = GetProgramHeader(ehdr);
   for (int i = 0; i < ehdr->e_phnum; ++i) {
     if (phdr[i].p_type != PT_LOAD)
       continue;
 
-    LinearAddress4Level dest_addr;
-    dest_addr.value = phdr[i].p_vaddr;
-    const auto num_4kpages = (phdr[i].p_memsz + 4095) / 4096;
-
-    if (auto err = SetupPageMaps(dest_addr, num_4kpages)) {
-      return err;
-    }
-
     const auto src = reinterpret_cast<uint8_t *>(ehdr) + phdr[i].p_offset;
-    const auto dst = reinterpret_cast<uint8_t *>(phdr[i].p_vaddr);
-    memcpy(dst, src, phdr[i].p_filesz);
-    memset(dst + phdr[i].p_filesz, 0, phdr[i].p_memsz - phdr[i].p_filesz);
+    task.Segments().push_back({phdr[i].p_vaddr, phdr[i].p_vaddr + phdr[i].p_memsz, src, phdr[i].p_filesz, false});
   }
-  return MAKE_ERROR(Error::kSuccess);
 }
 
-Error LoadELF(Elf64_Ehdr *ehdr) {
+Error LoadELF(AppImage &image, Task &task) {
+  auto ehdr = reinterpret_cast<Elf64_Ehdr *>(&image.file_buf[0]);
   if (ehdr->e_type != ET_EXEC) {
     return MAKE_ERROR(Error::kInvalidFormat);
   }
@@ -216,10 +113,12 @@ Error LoadELF(Elf64_Ehdr *ehdr) {
     return MAKE_ERROR(Error::kInvalidFormat);
   }
 
-  if (auto err = CopyLoadSegments(ehdr)) {
-    return err;
+  RecordLoadSegments(ehdr, task);
+  for (const auto &[vaddr, frame] : image.shared_pages) {
+    if (auto err = MapSharedPage(LinearAddress4Level{vaddr}, frame)) {
+      return err;
+    }
   }
-
   return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -229,12 +128,19 @@ WithError<PageMapEntry *> SetupPML4(Task &current_task) {
     return pml4;
   }
 
-  const auto current_pml4 = reinterpret_cast<PageMapEntry *>(GetCR3());
-  memcpy(pml4.value, current_pml4, 256 * sizeof(uint64_t));
+  auto [pcid, err] = AllocatePCID();
+  if (err) {
+    FreePageMap(pml4.value);
+    return {nullptr, err};
+  }
 
-  const auto cr3 = reinterpret_cast<uint64_t>(pml4.value);
+  memcpy(pml4.value, CurrentPML4(), 256 * sizeof(uint64_t));
+
+  // loading without the no-flush bit drops whatever the previous owner of pcid left in the TLB
+  const auto cr3 = reinterpret_cast<uint64_t>(pml4.value) | pcid;
   SetCR3(cr3);
   current_task.Context().cr3 = cr3;
+  current_task.PCID() = pcid;
   return pml4;
 }
 
@@ -242,9 +148,13 @@ Error FreePML4(Task &current_task) {
   const auto cr3 = current_task.Context().cr3;
   current_task.Context().cr3 = 0;
   ResetCR3();
+  FreePCID(current_task.PCID());
+  current_task.PCID() = 0;
 
-  const FrameID frame{cr3 / kBytesPerFrame};
-  return memory_manager->Free(frame, 1);
+  // the kernel half copied in by SetupPML4 is still there
+  const auto pml4 = reinterpret_cast<PageMapEntry *>(cr3 & ~static_cast<uint64_t>(0xfff));
+  memset(pml4, 0, kBytesPerFrame);
+  return FreePageMap(pml4);
 }
 
 void ListAllEntries(uint32_t dir_cluster) {
@@ -282,8 +192,7 @@ size_t TerminalFileDescriptor::Read(void *buf, size_t len) {
     __asm__("cli");
     auto msg = task_.ReceiveMessage();
     if (!msg) {
-      // TODO: why can"t I Sleep here?
-      // task_.Sleep();
+      task_.Sleep();
       __asm__("sti");
       continue;
     }
@@ -340,6 +249,9 @@ size_t PipeDescriptor::Read(void *buf, size_t len) {
       task_.Sleep();
       continue;
     }
+    if (auto writer = blocked_writer_.exchange(nullptr)) {
+      task_manager->Wakeup(writer);
+    }
     __asm__("sti");
 
     if (msg->type != Message::kPipe) {
@@ -367,9 +279,7 @@ size_t PipeDescriptor::Write(const void *buf, size_t len) {
     msg.arg.pipe.len = std::min(len - sent_bytes, sizeof(msg.arg.pipe.data));
     memcpy(msg.arg.pipe.data, &bufc[sent_bytes], msg.arg.pipe.len);
     sent_bytes += msg.arg.pipe.len;
-    __asm__("cli");
-    task_.SendMessage(msg);
-    __asm__("sti");
+    Send(msg);
   }
   return len;
 }
@@ -377,21 +287,26 @@ size_t PipeDescriptor::Write(const void *buf, size_t len) {
 void PipeDescriptor::FinishWrite() {
   Message msg{Message::kPipe};
   msg.arg.pipe.len = 0;
+  Send(msg);
+}
+
+// a pipe must not lose data, so the writer sleeps while the reader's mailbox is full.
+// The writer registers before retrying, so a reader draining the ring on another CPU in between wakes it.
+void PipeDescriptor::Send(const Message &msg) {
   __asm__("cli");
-  task_.SendMessage(msg);
+  while (task_.SendMessage(msg)) {
+    Task &writer = task_manager->CurrentTask();
+    blocked_writer_.store(&writer);
+    if (!task_.SendMessage(msg)) {
+      break;
+    }
+    writer.Sleep();
+  }
   __asm__("sti");
 }
 
-WithError<int> ExecuteFile(const fat::DirectoryEntry &file_entry, char *cmd, char *first_arg, std::array<std::shared_ptr<FileDescriptor>, 3> files) {
-  std::vector<uint8_t> file_buf(file_entry.file_size);
-  fat::LoadFile(&file_buf[0], file_buf.size(), file_entry);
-
-  Elf64_Ehdr *efl_header = reinterpret_cast<Elf64_Ehdr *>(&file_buf[0]);
-  if (memcmp(efl_header->e_ident, "\x7f"
-                                  "ELF",
-             4) != 0) {
-    return {0, MAKE_ERROR(Error::kInvalidFormat)};
-  }
+WithError<int> ExecuteImage(AppImage &image, char *cmd, char *first_arg, std::array<std::shared_ptr<FileDescriptor>, 3> files) {
+  Elf64_Ehdr *efl_header = reinterpret_cast<Elf64_Ehdr *>(&image.file_buf[0]);
 
   __asm__("cli");
   auto &task = task_manager->CurrentTask();
@@ -401,7 +316,8 @@ WithError<int> ExecuteFile(const fat::DirectoryEntry &file_entry, char *cmd, cha
     return {0, pml4.error};
   }
 
-  if (auto err = LoadELF(efl_header)) {
+  task.Segments().clear();
+  if (auto err = LoadELF(image, task)) {
     return {0, err};
   }
 
@@ -418,24 +334,29 @@ WithError<int> ExecuteFile(const fat::DirectoryEntry &file_entry, char *cmd, cha
     return {0, argc.error};
   }
 
-  LinearAddress4Level stack_frame_addr{0xffff'ffff'ffff'e000};
-  if (auto err = SetupPageMaps(stack_frame_addr, 1)) {
-    return {0, err};
-  }
+  task.Segments().push_back({kAppStackEnd - kAppStackBytes, kAppStackEnd, nullptr, 0, true});
 
   for (int i = 0; i < files.size(); ++i) {
     task.Files().push_back(files[i]);
   }
 
   auto entry_addr = efl_header->e_entry;
-  int ret = CallApp(argc.value, argv, kUserSS | 3, entry_addr, stack_frame_addr.value + 4096 - 8, &task.OSStackPointer());
+  int ret = CallApp(argc.value, argv, kUserSS | 3, entry_addr, kAppStackEnd - 8, &task.OSStackPointer());
 
   task.Files().clear();
+  task.Segments().clear();
+  if (auto &timer = task.PeriodicTimer()) {
+    timer_manager->CancelTimer(*timer);
+    timer.reset();
+  }
 
   const auto addr_first = GetFirstLoadAddress(efl_header);
   if (auto err = CleanPageMaps(LinearAddress4Level{addr_first})) {
     return {0, err};
   }
+  if (auto err = CleanPageMaps(args_frame_addr)) {
+    return {0, err};
+  }
 
   if (auto err = FreePML4(task)) {
     return {0, err};
@@ -444,6 +365,17 @@ WithError<int> ExecuteFile(const fat::DirectoryEntry &file_entry, char *cmd, cha
   return {ret, MAKE_ERROR(Error::kSuccess)};
 }
 
+WithError<int> ExecuteFile(const fat::DirectoryEntry &file_entry, char *cmd, char *first_arg, std::array<std::shared_ptr<FileDescriptor>, 3> files) {
+  auto [image, err] = AcquireAppImage(file_entry);
+  if (err) {
+    return {0, err};
+  }
+
+  auto ret = ExecuteImage(*image, cmd, first_arg, files);
+  ReleaseAppImage(image);
+  return ret;
+}
+
 void ExecuteCommand(std::string line, std::array<std::shared_ptr<FileDescriptor>, 3> files) {
   char *cmd = &line[0];
   char *arg = strchr(&line[0], ' ');
@@ -467,7 +399,7 @@ void ExecuteCommand(std::string line, std::array<std::shared_ptr<FileDescriptor>
     }
 
     auto &subtask = task_manager->NewTask();
-    pipe_fd = std::make_shared<PipeDescriptor>(subtask);
+    pipe_fd = MakeShared<PipeDescriptor>(subtask);
     auto term_desc = new TerminalDescriptor{
         subcommand, {pipe_fd, files[1], files[2]}};
     files[1] = pipe_fd;
@@ -494,7 +426,7 @@ void ExecuteCommand(std::string line, std::array<std::shared_ptr<FileDescriptor>
       PrintToFD(*files[2], "cannot redirect to a directory\n");
       return;
     }
-    files[1] = std::make_shared<fat::FileDescriptor>(*file);
+    files[1] = MakeShared<fat::FileDescriptor>(*file);
   }
 
   if (!strcmp(cmd, "echo")) {
@@ -504,6 +436,29 @@ void ExecuteCommand(std::string line, std::array<std::shared_ptr<FileDescriptor>
       PrintToFD(*files[1], "%s", arg);
     }
     PrintToFD(*files[1], "\n");
+  } else if (!strcmp(cmd, "bench")) {
+    RunBenchmark(arg, *files[1]);
+  } else if (!strcmp(cmd, "meminfo")) {
+    PrintToFD(*files[1], "heap: %lu KiB used, %lu KiB mapped\n", KernelHeapUsedBytes() / 1024, KernelHeapMappedBytes() / 1024);
+    const auto pool = GetZeroedPoolStats();
+    PrintToFD(*files[1], "zeroed pool: %lu frames, %lu hits, %lu misses\n", pool.frames, pool.hits, pool.misses);
+    const auto maps = GetPageMapCacheStats();
+    PrintToFD(*files[1], "page map cache: %lu frames, %lu hits, %lu misses\n", maps.frames, maps.hits, maps.misses);
+    const auto apps = GetAppCacheStats();
+    PrintToFD(*files[1], "app cache: %lu images, %lu shared frames, %lu hits, %lu misses, %lu frames saved\n",
+              apps.images, apps.shared_frames, apps.hits, apps.misses, apps.frames_saved);
+    PrintSlabStats(*files[1]);
+  } else if (!strcmp(cmd, "tickinfo")) {
+    const auto clock = GetClockInfo();
+    PrintToFD(*files[1], "TSC: %lu kHz%s, LAPIC timer: %lu kHz, %s mode\n", clock.tsc_freq / 1000,
+              clock.invariant_tsc ? " invariant" : "", clock.lapic_freq / 1000,
+              clock.tsc_deadline ? "TSC-deadline" : "periodic");
+    PrintToFD(*files[1], "uptime: %lu ms, %lu ticks\n", NowNanoseconds() / 1'000'000, timer_manager->CurrentTick());
+    for (int cpu = 0; cpu < NumCPUs(); ++cpu) {
+      const auto stats = GetTickStats(cpu);
+      PrintToFD(*files[1], "cpu %d: %lu interrupts, %lu preemptions, %lu tickless sleeps, %lu ticks skipped\n",
+                cpu, stats.interrupts, stats.preemptions, stats.tickless_sleeps, stats.ticks_skipped);
+    }
   } else if (!strcmp(cmd, "clear")) {
     console->Clear();
   } else if (!strcmp(cmd, "ls")) {
@@ -596,7 +551,7 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
     }
   } else {
     for (int i = 0; i < files.size(); ++i) {
-      files[i] = std::make_shared<TerminalFileDescriptor>(task);
+      files[i] = MakeShared<TerminalFileDescriptor>(task);
     }
   }
 
@@ -610,20 +565,26 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
   }
 
   std::string line_buf;
+  RecordBootPhase("first prompt");
   console->PutString("> ");
 
+  std::array<Message, 16> msgs;
   while (true) {
     __asm__("cli");
-    auto msg = task.ReceiveMessage();
-    if (!msg) {
+    const auto num_msgs = task.ReceiveMessages(msgs.data(), msgs.size());
+    if (num_msgs == 0) {
       task.Sleep();
       __asm__("sti");
       continue;
     }
     __asm__("sti");
 
-    if (msg->type == Message::kKeyboardPush) {
-      char c = msg->arg.keyboard.keycode & kKeyCharMask;
+    for (size_t i = 0; i < num_msgs; ++i) {
+      if (msgs[i].type != Message::kKeyboardPush) {
+        continue;
+      }
+
+      char c = msgs[i].arg.keyboard.keycode & kKeyCharMask;
       console->PutChar(c);
 
       if (c == '\n') {
@@ -1,7 +1,11 @@
 #pragma once
+#include "error.hpp"
 #include "fat.hpp"
 #include "file.hpp"
 #include "task.hpp"
+#include <array>
+#include <atomic>
+#include <memory>
 #include <stdint.h>
 #include <string>
 
@@ -24,10 +28,13 @@ public:
   void FinishWrite();
 
 private:
+  void Send(const Message &msg);
+
   Task &task_;
   char data_[16];
   size_t len_{0};
   bool closed_{false};
+  std::atomic<Task *> blocked_writer_{nullptr};
 };
 
 struct TerminalDescriptor {
@@ -36,3 +43,5 @@ struct TerminalDescriptor {
 };
 
 void TaskTerminal(uint64_t task_id, int64_t data);
+
+WithError<int> ExecuteFile(const fat::DirectoryEntry &file_entry, char *cmd, char *first_arg, std::array<std::shared_ptr<FileDescriptor>, 3> files);
@@ -1,25 +1,155 @@
 #include "timer.hpp"
+#include "acpi.hpp"
+#include "asmfunc.hpp"
 #include "interrupt.hpp"
+#include "printk.hpp"
+#include "smp.hpp"
 #include "task.hpp"
+#include <algorithm>
+#include <array>
+#include <cpuid.h>
 #include <limits>
-
-const int kTaskTimerPeriod = 2;
-const int kTaskTimerValue = std::numeric_limits<int>::min();
+#include <utility>
 
 namespace {
 const uint32_t kCountMax = 0xffffffffu;
+const uint32_t kLVTMasked = 1u << 16;
+const uint32_t kLVTPeriodic = 0b010 << 16;
+const uint32_t kLVTTSCDeadline = 0b100 << 16;
+const uint32_t kCPUIDTSCDeadline = 1u << 24;
+const uint32_t kCPUIDInvariantTSC = 1u << 8;
+const uint32_t kIA32TSCDeadline = 0x6e0;
 volatile uint32_t &lvt_timer = *reinterpret_cast<uint32_t *>(0xfee00320);
 volatile uint32_t &initial_count = *reinterpret_cast<uint32_t *>(0xfee00380);
 volatile uint32_t &current_count = *reinterpret_cast<uint32_t *>(0xfee00390);
 volatile uint32_t &divide_config = *reinterpret_cast<uint32_t *>(0xfee003e0);
+// the IRR word holding the timer vector
+volatile uint32_t &timer_irr = *reinterpret_cast<uint32_t *>(0xfee00200 + 0x10 * (InterruptVector::kLAPICTimer / 32));
+
+const size_t kInitialTimerNodes = 64;
+
+// the PIT can count down 54 ms at most
+const unsigned long kCalibrationMillis = 50;
+const uint32_t kPITFreq = 1193182;
+
+ClockInfo clock_info;
+uint64_t tsc_base;
+// nanoseconds per TSC cycle in 32.32 fixed point
+uint64_t ns_per_cycle;
+uint32_t counts_per_tick;
+uint64_t cycles_per_tick;
+// the longest sleep of EnterTicklessIdle that the timer can count
+unsigned long max_sleep_ticks;
+
+struct LocalTimer {
+  bool preempt{true};
+  int quantum_ticks{0};
+  // set while a one-shot interrupt replaces the periodic tick
+  bool one_shot{false};
+  // the TSC at the next tick boundary, in TSC-deadline mode
+  uint64_t next_deadline;
+  // in counter mode, where the sleep can only be measured against the count it started with;
+  // phase is how far into a tick the sleep began
+  unsigned long one_shot_ticks;
+  uint32_t one_shot_count, phase;
+  TickStats stats{};
+};
+std::array<LocalTimer, kMaxCPUs> local_timers;
+
+// channel 2 counts down once in mode 0 and raises bit 5 of port 0x61 when it reaches zero
+void WaitPIT(unsigned long msec) {
+  const uint32_t count = kPITFreq * msec / 1000;
+  Outb(0x61, (Inb(0x61) & ~0x02) | 0x01); // gate on, speaker off
+  Outb(0x43, 0b10110000);
+  Outb(0x42, count & 0xff);
+  Outb(0x42, count >> 8);
+  while (!(Inb(0x61) & 0x20))
+    ;
+}
+
+// measures the TSC and the LAPIC timer against the ACPI PM timer, or the PIT when there is none
+void Calibrate() {
+  const auto rflags = DisableInterrupts();
+  divide_config = 0b1011;
+  lvt_timer = kLVTMasked;
+
+  const auto tsc_begin = ReadTSC();
+  StartLAPICTimer();
+  if (acpi::fadt) {
+    acpi::WaitMilliseconds(kCalibrationMillis);
+  } else {
+    WaitPIT(kCalibrationMillis);
+  }
+  const auto elapsed = LAPICTimerElapsed();
+  const auto tsc_end = ReadTSC();
+  StopLAPICTimer();
+  RestoreInterrupts(rflags);
+
+  clock_info.lapic_freq = static_cast<uint64_t>(elapsed) * (1000 / kCalibrationMillis);
+  clock_info.tsc_freq = (tsc_end - tsc_begin) * (1000 / kCalibrationMillis);
+  tsc_base = tsc_end;
+  ns_per_cycle = (1'000'000'000ul << 32) / clock_info.tsc_freq;
+  counts_per_tick = clock_info.lapic_freq / kTimerFreq;
+  cycles_per_tick = clock_info.tsc_freq / kTimerFreq;
+
+  unsigned int eax, ebx, ecx, edx;
+#ifndef DISABLE_TSC_DEADLINE
+  clock_info.tsc_deadline = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & kCPUIDTSCDeadline);
+#endif
+  clock_info.invariant_tsc = __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & kCPUIDInvariantTSC);
+  max_sleep_ticks = clock_info.tsc_deadline ? kCountMax : kCountMax / counts_per_tick;
+  if (!clock_info.invariant_tsc) {
+    printk("TSC is not invariant; the clock may drift\n");
+  }
+}
+
+// counts the tick boundaries the TSC has passed and moves next_deadline beyond them
+unsigned long CatchUpDeadline(LocalTimer &local) {
+  const auto now = ReadTSC();
+  if (now < local.next_deadline) {
+    return 0;
+  }
+  const unsigned long ticks = 1 + (now - local.next_deadline) / cycles_per_tick;
+  local.next_deadline += ticks * cycles_per_tick;
+  return ticks;
+}
+
+void StartPeriodicTimer(LocalTimer &local) {
+  if (clock_info.tsc_deadline) {
+    lvt_timer = kLVTTSCDeadline | InterruptVector::kLAPICTimer;
+    // orders the LVT write before the MSR write
+    __asm__ volatile("mfence" ::: "memory");
+    local.next_deadline = ReadTSC() + cycles_per_tick;
+    WriteMSR(kIA32TSCDeadline, local.next_deadline);
+    return;
+  }
+
+  divide_config = 0b1011;
+  lvt_timer = kLVTPeriodic | InterruptVector::kLAPICTimer;
+  initial_count = counts_per_tick;
+}
+
+void StopPeriodicTimer() {
+  if (clock_info.tsc_deadline) {
+    WriteMSR(kIA32TSCDeadline, 0);
+  } else {
+    initial_count = 0;
+  }
+}
+
+bool TimerInterruptPending() {
+  return timer_irr & (1u << (InterruptVector::kLAPICTimer % 32));
+}
 } // namespace
 
 void InitializeLAPICTimer() {
   timer_manager = new TimerManager();
+  Calibrate();
+  StartPeriodicTimer(local_timers[0]);
+}
 
-  divide_config = 0b1011;
-  lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer;
-  initial_count = 0x1000000u;
+void InitializeLAPICTimerForAP() {
+  StartPeriodicTimer(local_timers[CurrentCPU()]);
 }
 
 void StartLAPICTimer() {
@@ -34,51 +164,350 @@ void StopLAPICTimer() {
   initial_count = 0;
 }
 
-Timer::Timer(unsigned long timeout, int value) : timeout_{timeout}, value_{value} {}
+uint64_t NowNanoseconds() {
+  return static_cast<unsigned __int128>(ReadTSC() - tsc_base) * ns_per_cycle >> 32;
+}
+
+void WaitNanoseconds(uint64_t nsec) {
+  const auto end = NowNanoseconds() + nsec;
+  while (NowNanoseconds() < end) {
+    __builtin_ia32_pause();
+  }
+}
+
+ClockInfo GetClockInfo() {
+  return clock_info;
+}
+
+void SetPreemptionTick(bool enable) {
+#ifndef DISABLE_TICKLESS
+  const int cpu = CurrentCPU();
+  auto &local = local_timers[cpu];
+  if (local.preempt == enable) {
+    return;
+  }
+
+  local.preempt = enable;
+  local.quantum_ticks = 0;
+  if (cpu != 0) {
+    if (enable) {
+      StartPeriodicTimer(local);
+    } else {
+      StopPeriodicTimer();
+    }
+  }
+#endif
+}
+
+// in counter mode, the first tick of the sleep only has the rest of the current period to go, so later ones stay in phase
+void EnterTicklessIdle() {
+#ifndef DISABLE_TICKLESS
+  if (CurrentCPU() != 0 || TimerInterruptPending()) {
+    return;
+  }
+  const auto ticks = std::min(timer_manager->TicksToNextTimeout(), max_sleep_ticks);
+  if (ticks < 2) {
+    return;
+  }
+
+  auto &local = local_timers[0];
+  local.one_shot = true;
+  ++local.stats.tickless_sleeps;
+  if (clock_info.tsc_deadline) {
+    WriteMSR(kIA32TSCDeadline, local.next_deadline + (ticks - 1) * cycles_per_tick);
+    return;
+  }
+
+  const uint32_t remaining = current_count;
+  local.one_shot_ticks = ticks;
+  local.one_shot_count = remaining + (ticks - 1) * counts_per_tick;
+  local.phase = counts_per_tick - remaining;
+
+  lvt_timer = InterruptVector::kLAPICTimer;
+  initial_count = local.one_shot_count;
+#endif
+}
+
+// Woken early by another interrupt. The TSC tells exactly how many ticks passed;
+// in counter mode an expiry right here may count one tick twice.
+void ExitTicklessIdle() {
+  const auto rflags = DisableInterrupts();
+  auto &local = local_timers[CurrentCPU()];
+  if (!local.one_shot) {
+    RestoreInterrupts(rflags);
+    return;
+  }
+
+  unsigned long ticks;
+  if (clock_info.tsc_deadline) {
+    // a pending expiry interrupt finds nothing left to account
+    ticks = CatchUpDeadline(local);
+    WriteMSR(kIA32TSCDeadline, local.next_deadline);
+  } else {
+    const uint32_t remaining = current_count;
+    if (remaining == 0 || TimerInterruptPending()) {
+      // the expiry interrupt is on its way and accounts the whole sleep
+      RestoreInterrupts(rflags);
+      return;
+    }
+    StartPeriodicTimer(local);
+    ticks = (local.one_shot_count - remaining + local.phase) / counts_per_tick;
+  }
+
+  local.one_shot = false;
+  local.stats.ticks_skipped += ticks;
+  if (ticks > 0) {
+    timer_manager->Tick(ticks);
+  }
+  RestoreInterrupts(rflags);
+}
+
+TickStats GetTickStats(int cpu) {
+  return local_timers[cpu].stats;
+}
+
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
+    : timeout_{timeout}, value_{value}, task_id_{task_id} {}
+
+TimerManager::TimerManager() : nodes_(kInitialTimerNodes) {
+  for (auto &heads : heads_) {
+    heads.fill(kNil);
+  }
+  for (uint32_t i = 0; i < nodes_.size(); ++i) {
+    nodes_[i].next = i + 1;
+  }
+  nodes_.back().next = kNil;
+  free_head_ = 0;
+}
 
-TimerManager::TimerManager() {
-  timers_.push(Timer{std::numeric_limits<unsigned long>::max(), -1});
+TimerHandle TimerManager::AddTimer(const Timer &timer) {
+  SpinLockGuard guard{lock_};
+  const uint32_t index = AllocateNode();
+  auto &node = nodes_[index];
+  node.timer = timer;
+  node.expirations = 0;
+  node.pending = true;
+  // a timeout in the past fires on the next tick
+  Link(index, std::max(timer.Timeout(), tick_ + 1));
+  ++num_pending_;
+  return {index, node.generation};
 }
 
-void TimerManager::AddTimer(const Timer &timer) {
-  timers_.push(timer);
+bool TimerManager::CancelTimer(TimerHandle handle) {
+  SpinLockGuard guard{lock_};
+  if (handle.index >= nodes_.size()) {
+    return false;
+  }
+  auto &node = nodes_[handle.index];
+  if (!node.pending || node.generation != handle.generation) {
+    return false;
+  }
+
+  Unlink(handle.index);
+  FreeNode(handle.index);
+  --num_pending_;
+  return true;
 }
 
-bool TimerManager::Tick() {
-  ++tick_;
+unsigned long TimerManager::TakeExpirations(TimerHandle handle) {
+  SpinLockGuard guard{lock_};
+  if (handle.index >= nodes_.size()) {
+    return 0;
+  }
+  auto &node = nodes_[handle.index];
+  if (!node.pending || node.generation != handle.generation) {
+    return 0;
+  }
+  return std::exchange(node.expirations, 0);
+}
 
-  bool task_timer_timeout = false;
+// jumps straight from one tick at which an occupied slot comes up to the next
+void TimerManager::Tick(unsigned long ticks) {
+  SpinLockGuard guard{lock_};
+  const unsigned long target = tick_ + ticks;
   while (true) {
-    const auto &t = timers_.top();
-    if (t.Timeout() > tick_) {
+    const auto next = NextEventTick();
+    if (next > target) {
       break;
     }
 
-    if (t.Value() == kTaskTimerValue) {
-      task_timer_timeout = true;
-      timers_.pop();
-      timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue});
+    tick_ = next;
+    for (int level = 1; level < kWheelLevels && (tick_ & ((1ul << (kWheelBits * level)) - 1)) == 0; ++level) {
+      Cascade(level);
+    }
+    Expire();
+  }
+  tick_ = target;
+}
+
+unsigned long TimerManager::TicksToNextTimeout() {
+  SpinLockGuard guard{lock_};
+  const auto next = NextEventTick();
+  return next == std::numeric_limits<unsigned long>::max() ? next : next - tick_;
+}
+
+// grows the pool here, in task context, so that Tick never allocates
+uint32_t TimerManager::AllocateNode() {
+  if (free_head_ == kNil) {
+    const uint32_t old_size = nodes_.size();
+    nodes_.resize(2 * old_size);
+    for (uint32_t i = old_size; i < nodes_.size(); ++i) {
+      nodes_[i].next = i + 1;
+    }
+    nodes_.back().next = kNil;
+    free_head_ = old_size;
+  }
+
+  const uint32_t index = free_head_;
+  free_head_ = nodes_[index].next;
+  return index;
+}
+
+void TimerManager::FreeNode(uint32_t index) {
+  auto &node = nodes_[index];
+  ++node.generation;
+  node.pending = false;
+  node.next = free_head_;
+  free_head_ = index;
+}
+
+// Files the node under the slot the clock reaches at timeout, in the lowest level whose range covers it.
+// A timeout beyond the top level waits in the farthest slot and is filed again from there.
+void TimerManager::Link(uint32_t index, unsigned long timeout) {
+  const unsigned long delta = std::min(timeout - tick_, (1ul << (kWheelBits * kWheelLevels)) - 1);
+  int level = 0;
+  while (delta >> (kWheelBits * (level + 1))) {
+    ++level;
+  }
+
+  auto &node = nodes_[index];
+  node.level = level;
+  node.slot = ((tick_ + delta) >> (kWheelBits * level)) & (kWheelSlots - 1);
+  node.prev = kNil;
+  node.next = heads_[level][node.slot];
+  if (node.next != kNil) {
+    nodes_[node.next].prev = index;
+  }
+  heads_[level][node.slot] = index;
+  occupied_[level] |= 1ul << node.slot;
+}
+
+void TimerManager::Unlink(uint32_t index) {
+  auto &node = nodes_[index];
+  if (node.prev != kNil) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    heads_[node.level][node.slot] = node.next;
+  }
+  if (node.next != kNil) {
+    nodes_[node.next].prev = node.prev;
+  }
+
+  if (heads_[node.level][node.slot] == kNil) {
+    occupied_[node.level] &= ~(1ul << node.slot);
+  }
+}
+
+// the first tick after tick_ at which the clock reaches an occupied slot of any level
+unsigned long TimerManager::NextEventTick() const {
+  unsigned long next = std::numeric_limits<unsigned long>::max();
+  for (int level = 0; level < kWheelLevels; ++level) {
+    const uint64_t occupied = occupied_[level];
+    if (occupied == 0) {
       continue;
     }
 
-    Message m{Message::kTimerTimeout};
-    m.arg.timer.timeout = t.Timeout();
-    m.arg.timer.value = t.Value();
-    task_manager->SendMessage(1, m);
+    const int shift = kWheelBits * level;
+    const unsigned long position = (tick_ >> shift) + 1;
+    // rotate so that bit 0 stands for the slot at position
+    const int start = position & (kWheelSlots - 1);
+    const uint64_t rotated = start == 0 ? occupied : (occupied >> start) | (occupied << (kWheelSlots - start));
+    next = std::min(next, (position + __builtin_ctzl(rotated)) << shift);
+  }
+  return next;
+}
 
-    timers_.pop();
+// the clock reached the slot's first tick; its timers all come due within the slot and move down
+void TimerManager::Cascade(int level) {
+  const int slot = (tick_ >> (kWheelBits * level)) & (kWheelSlots - 1);
+  uint32_t index = heads_[level][slot];
+  heads_[level][slot] = kNil;
+  occupied_[level] &= ~(1ul << slot);
+
+  while (index != kNil) {
+    const uint32_t next = nodes_[index].next;
+    Link(index, nodes_[index].timer.Timeout());
+    index = next;
   }
+}
+
+// Notifies the tasks of every timeout in the slot at tick_ in one pass. A periodic timer
+// goes back into the wheel with the same node, so nothing is allocated here.
+void TimerManager::Expire() {
+  const int slot = tick_ & (kWheelSlots - 1);
+  uint32_t index = heads_[0][slot];
+  heads_[0][slot] = kNil;
+  occupied_[0] &= ~(1ul << slot);
+
+  while (index != kNil) {
+    auto &node = nodes_[index];
+    auto &timer = node.timer;
+    const uint32_t next = node.next;
 
-  return task_timer_timeout;
+    if (timer.WakeupOnly()) {
+      task_manager->Wakeup(timer.TaskID());
+    } else {
+      Message m{Message::kTimerTimeout};
+      m.arg.timer.timeout = timer.Timeout();
+      m.arg.timer.value = timer.Value();
+      task_manager->SendMessage(timer.TaskID(), m);
+    }
+
+    if (timer.Period() > 0) {
+      // a timeout added in the past may have missed several periods
+      do {
+        timer.timeout_ += timer.Period();
+        ++node.expirations;
+      } while (timer.timeout_ <= tick_);
+      Link(index, timer.Timeout());
+    } else {
+      FreeNode(index);
+      --num_pending_;
+    }
+    index = next;
+  }
 }
 
 TimerManager *timer_manager;
 
 void LAPICTimerOnInterrupt(const TaskContext &ctx_stack) {
-  const bool task_timer_timeout = timer_manager->Tick();
+  const int cpu = CurrentCPU();
+  auto &local = local_timers[cpu];
+  ++local.stats.interrupts;
+
+  unsigned long ticks = 1;
+  if (clock_info.tsc_deadline) {
+    // an AP whose tick was stopped may still see one that was pending
+    if (cpu == 0 || local.preempt) {
+      ticks = CatchUpDeadline(local);
+      WriteMSR(kIA32TSCDeadline, local.next_deadline);
+    }
+  } else if (local.one_shot) {
+    ticks = local.one_shot_ticks;
+    StartPeriodicTimer(local);
+  }
+  if (local.one_shot && ticks > 0) {
+    local.one_shot = false;
+    local.stats.ticks_skipped += ticks - 1;
+  }
+  if (cpu == 0 && ticks > 0) {
+    timer_manager->Tick(ticks);
+  }
   NotifyEndOfInterrupt();
 
-  if (task_timer_timeout) {
+  if (local.preempt && (local.quantum_ticks += ticks) >= kTaskTimerPeriod) {
+    local.quantum_ticks = 0;
+    ++local.stats.preemptions;
     task_manager->SwitchTask(ctx_stack);
   }
 }
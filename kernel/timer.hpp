@@ -1,46 +1,153 @@
 #pragma once
 
 #include "message.hpp"
-#include "task.hpp"
-#include <deque>
+#include "spinlock.hpp"
+#include <array>
 #include <limits>
-#include <queue>
 #include <stdint.h>
+#include <vector>
 
+// timer_manager ticks per second
+const int kTimerFreq = 100;
+// 20 ms of CPU time before a task is preempted
+const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
+
+inline unsigned long MillisecondsToTicks(unsigned long msec) {
+  return (msec * kTimerFreq + 999) / 1000;
+}
+
+inline unsigned long NanosecondsToTicks(uint64_t nsec) {
+  const uint64_t nsec_per_tick = 1'000'000'000 / kTimerFreq;
+  // rounds up without the sum wrapping for nsec near the maximum
+  return nsec / nsec_per_tick + (nsec % nsec_per_tick != 0);
+}
+
+// Calibrates the TSC and the LAPIC timer and starts the tick, in TSC-deadline mode if the CPU has it.
 void InitializeLAPICTimer();
+// The APs' timers only drive preemption; timer_manager is ticked by the BSP alone.
+void InitializeLAPICTimerForAP();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
 
+// Nanoseconds since InitializeLAPICTimer, read from the TSC. The same on every CPU as long as their TSCs agree.
+uint64_t NowNanoseconds();
+void WaitNanoseconds(uint64_t nsec);
+
+struct ClockInfo {
+  uint64_t tsc_freq, lapic_freq;
+  bool tsc_deadline, invariant_tsc;
+};
+ClockInfo GetClockInfo();
+
+// Whether the calling CPU's timer preempts the running task. An AP's timer does nothing else,
+// so it stops altogether while off; the BSP's keeps ticking timer_manager.
+void SetPreemptionTick(bool enable);
+// On the BSP, replaces the periodic tick with one interrupt at the next timer deadline.
+// Called by the idle task with interrupts masked right before it halts.
+void EnterTicklessIdle();
+// Accounts the ticks slept so far and goes back to the periodic tick, if EnterTicklessIdle left it.
+void ExitTicklessIdle();
+
+struct TickStats {
+  unsigned long interrupts, preemptions, tickless_sleeps, ticks_skipped;
+};
+TickStats GetTickStats(int cpu);
+
+struct TaskContext;
 extern "C" void LAPICTimerOnInterrupt(const TaskContext &ctx_stack);
 
+class TimerManager;
+
+// Sends kTimerTimeout with its value to the task when it fires, or only wakes the task up.
 class Timer {
 public:
-  Timer(unsigned long timeout, int value);
+  Timer(unsigned long timeout, int value, uint64_t task_id = 1);
   unsigned long Timeout() const { return timeout_; }
   int Value() const { return value_; }
+  uint64_t TaskID() const { return task_id_; }
+  // ticks between two timeouts of a periodic timer, or 0 for a one-shot one
+  unsigned long Period() const { return period_; }
+  bool WakeupOnly() const { return wakeup_only_; }
+
+  Timer &SetPeriod(unsigned long period) {
+    period_ = period;
+    return *this;
+  }
+  Timer &SetWakeupOnly() {
+    wakeup_only_ = true;
+    return *this;
+  }
 
 private:
   unsigned long timeout_;
   int value_;
+  uint64_t task_id_;
+  unsigned long period_{0};
+  bool wakeup_only_{false};
+
+  friend TimerManager;
 };
 
-inline bool operator<(const Timer &lhs, const Timer &rhs) {
-  return lhs.Timeout() > rhs.Timeout();
-}
+// Names a pending timer for CancelTimer; it goes stale once the timer fires or is canceled.
+struct TimerHandle {
+  uint32_t index, generation;
+};
 
+// A hierarchical timer wheel. Level L has kWheelSlots slots of kWheelSlots^L ticks each; a timer
+// sits in the lowest level whose range covers its timeout, and moves down a level when the clock
+// reaches its slot. Every slot is an intrusive list of pooled nodes, so adding and canceling are O(1)
+// and Tick never allocates.
 class TimerManager {
 public:
+  static const int kWheelBits = 6;
+  static const int kWheelSlots = 1 << kWheelBits;
+  static const int kWheelLevels = 4;
+
   TimerManager();
-  void AddTimer(const Timer &timer);
-  bool Tick();
+  // May grow the node pool, so it must not be called from an interrupt handler.
+  TimerHandle AddTimer(const Timer &timer);
+  // Returns false if the timer has already fired or been canceled.
+  bool CancelTimer(TimerHandle handle);
+  // Returns how often the periodic timer fired since the last call, and resets the count.
+  // Returns 0 for a stale handle as well.
+  unsigned long TakeExpirations(TimerHandle handle);
+  // Advances the clock by ticks and sends the timeouts that came due.
+  void Tick(unsigned long ticks = 1);
   unsigned long CurrentTick() const { return tick_; }
+  // Ticks until the next timeout or until a timer moves down a level, whichever comes first.
+  unsigned long TicksToNextTimeout();
+  size_t PendingTimers() const { return num_pending_; }
 
 private:
+  static constexpr uint32_t kNil = std::numeric_limits<uint32_t>::max();
+
+  struct Node {
+    Timer timer{0, 0};
+    uint32_t prev, next;
+    // bumped whenever the node is freed, which turns its handles stale
+    uint32_t generation{0};
+    unsigned long expirations;
+    uint8_t level, slot;
+    bool pending{false};
+  };
+
   volatile unsigned long tick_{0};
-  std::priority_queue<Timer> timers_{};
+  std::vector<Node> nodes_;
+  uint32_t free_head_{kNil};
+  size_t num_pending_{0};
+  std::array<std::array<uint32_t, kWheelSlots>, kWheelLevels> heads_;
+  // bit i of occupied_[L] is set while slot i of level L holds a timer
+  std::array<uint64_t, kWheelLevels> occupied_{};
+  SpinLock lock_;
+
+  uint32_t AllocateNode();
+  void FreeNode(uint32_t index);
+  void Link(uint32_t index, unsigned long timeout);
+  void Unlink(uint32_t index);
+  unsigned long NextEventTick() const;
+  void Cascade(int level);
+  void Expire();
 };
 
 extern TimerManager *timer_manager;
-
-extern const int kTaskTimerPeriod, kTaskTimerValue;